@@ -0,0 +1,225 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "clocksync.h"
+#include "fhz.h"
+#include "loop.h"
+#include "txq.h"
+
+/*
+ * FHTs keep their own clock, which drifts. A sweep walks over all known
+ * FHTs, one after the other. The clock an FHT reported last, plus the time
+ * that has passed since, is what it shows now. If that is off by more than
+ * CLOCKSYNC_TOLERANCE, the registers that differ are written. Hour and
+ * minute are always written together, a minute without its hour may be
+ * off by an hour. An FHT whose clock wasn't reported within
+ * CLOCKSYNC_MAX_AGE, or not completely, gets all of them. The writes are
+ * bulk work: the queue holds them back for a moment and sends the
+ * registers of an FHT in a single frame.
+ *
+ * FHTs only pick up commands every two minutes or so, a clock that was
+ * just set is therefore off by up to that much.
+ *
+ * Like the prefetch, a sweep doesn't flood the transmit queues. The next
+ * FHT is only updated once the queue of its FHZ has drained below the
+ * window, and at most every CLOCKSYNC_SPACING.
+ *
+ * Around midnight, the date of an FHT may already or still be another one,
+ * sweeps wait until CLOCKSYNC_GUARD minutes have passed.
+ *
+ * FHTs are only known once they transmitted, the first sweep waits a few
+ * of their transmission cycles.
+ */
+#define CLOCKSYNC_GUARD 10
+#define CLOCKSYNC_RETRY (60 * 1000)
+#define CLOCKSYNC_DELAY (5 * 60 * 1000)
+/* in s */
+#define CLOCKSYNC_TOLERANCE (3 * 60)
+#define CLOCKSYNC_MAX_AGE (24 * 60 * 60)
+
+static struct loop_timer clocksync_timer;
+static unsigned int clocksync_interval;
+static struct fht_device *clocksync_next;
+static unsigned int clocksync_count;
+static bool clocksync_sweeping;
+
+/* the registers of the clock, like the values of clocksync_device() */
+static const unsigned char clocksync_regs[] = {
+	FHT_YEAR, FHT_MONTH, FHT_DAY, FHT_HOUR, FHT_MINUTE,
+};
+
+/* what the clock of the FHT shows now, false if that isn't known */
+static bool clocksync_fht_clock(const struct fht_device *device, time_t now,
+				time_t *clock)
+{
+	struct tm tm = { .tm_isdst = -1 };
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(clocksync_regs); i++)
+		if (!fht_device_valid(device, clocksync_regs[i]))
+			return false;
+	if (!device->clock_reported || device->clock_reported > now ||
+	    now - device->clock_reported > CLOCKSYNC_MAX_AGE)
+		return false;
+
+	tm.tm_year = FHT_YEAR_BASE + device->reg[FHT_YEAR] - 1900;
+	tm.tm_mon = device->reg[FHT_MONTH] - 1;
+	tm.tm_mday = device->reg[FHT_DAY];
+	tm.tm_hour = device->reg[FHT_HOUR];
+	tm.tm_min = device->reg[FHT_MINUTE];
+	*clock = mktime(&tm);
+	if (*clock == -1)
+		return false;
+
+	/* it kept counting since */
+	*clock += now - device->clock_reported;
+
+	return true;
+}
+
+/* returns the number of registers that were queued */
+static int clocksync_device(struct fht_device *device, struct fhz *fhz,
+			    time_t now, const struct tm *tm)
+{
+	const struct hauscode hauscode = fht_device_hauscode(device);
+	struct fht_command_value clock[] = {
+		{ FHT_YEAR, tm->tm_year + 1900 - FHT_YEAR_BASE },
+		{ FHT_MONTH, tm->tm_mon + 1 },
+		{ FHT_DAY, tm->tm_mday },
+		{ FHT_HOUR, tm->tm_hour },
+		{ FHT_MINUTE, tm->tm_min },
+	};
+	bool write[ARRAY_SIZE(clock)];
+	unsigned int i, n = 0;
+	struct tm fht_tm;
+	time_t fht;
+	int err;
+
+	if (!clocksync_fht_clock(device, now, &fht)) {
+		for (i = 0; i < ARRAY_SIZE(clock); i++)
+			write[i] = true;
+	} else if (fht >= now - CLOCKSYNC_TOLERANCE &&
+		   fht <= now + CLOCKSYNC_TOLERANCE) {
+		return 0;
+	} else {
+		localtime_r(&fht, &fht_tm);
+		write[0] = fht_tm.tm_year != tm->tm_year;
+		write[1] = fht_tm.tm_mon != tm->tm_mon;
+		write[2] = fht_tm.tm_mday != tm->tm_mday;
+		/* hour and minute */
+		write[3] = write[4] = true;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(clock); i++)
+		n += write[i];
+	if (n > txq_space(fhz->txq))
+		return -ENOBUFS;
+
+	for (i = 0; i < ARRAY_SIZE(clock); i++) {
+		if (!write[i])
+			continue;
+		err = txq_push(fhz->txq, &hauscode, clock[i].function_id,
+			       clock[i].value, TXQ_PRIO_LOW, NULL);
+		if (err)
+			return err;
+	}
+
+	return n;
+}
+
+static bool clocksync_midnight(const struct tm *tm)
+{
+	return (tm->tm_hour == 23 && tm->tm_min >= 60 - CLOCKSYNC_GUARD) ||
+	       (tm->tm_hour == 0 && tm->tm_min < CLOCKSYNC_GUARD);
+}
+
+static void clocksync_run(struct loop_timer *timer)
+{
+	struct fht_device *device;
+	struct hauscode hauscode;
+	struct fhz *fhz;
+	struct tm tm;
+	time_t now;
+	int ret;
+
+	now = time(NULL);
+	localtime_r(&now, &tm);
+	if (clocksync_midnight(&tm)) {
+		loop_timer_add(timer, CLOCKSYNC_RETRY);
+		return;
+	}
+
+	if (!clocksync_sweeping) {
+		clocksync_sweeping = true;
+		clocksync_next = fht_device_next(NULL);
+		clocksync_count = 0;
+	}
+
+	while ((device = clocksync_next)) {
+		hauscode = fht_device_hauscode(device);
+		fhz = fhz_route(&hauscode);
+		if (!fhz || !fhz->txq) {
+			clocksync_next = fht_device_next(device);
+			continue;
+		}
+
+		if (txq_depth(fhz->txq) >= txq_config.window) {
+			loop_timer_add(timer, CLOCKSYNC_SPACING);
+			return;
+		}
+
+		clocksync_next = fht_device_next(device);
+		ret = clocksync_device(device, fhz, now, &tm);
+		if (ret < 0)
+			warning("fht %02u%02u: clock sync failed: %s\n",
+				hauscode.upper, hauscode.lower,
+				strerror(-ret));
+		/* its clock is right, no need to wait */
+		if (!ret)
+			continue;
+
+		if (ret > 0)
+			clocksync_count++;
+		loop_timer_add(timer, CLOCKSYNC_SPACING);
+		return;
+	}
+
+	info("clock sync: updated %u FHTs\n", clocksync_count);
+	clocksync_sweeping = false;
+	loop_timer_add(timer, clocksync_interval * 60 * 1000);
+}
+
+int clocksync_start(unsigned int interval)
+{
+	/* loop timers take up to UINT_MAX ms */
+	if (!interval || interval > UINT_MAX / (60 * 1000))
+		return -EINVAL;
+
+	clocksync_interval = interval;
+	clocksync_sweeping = false;
+
+	clocksync_timer.handler = clocksync_run;
+	loop_timer_add(&clocksync_timer, CLOCKSYNC_DELAY);
+
+	return 0;
+}
+
+void clocksync_stop(void)
+{
+	loop_timer_del(&clocksync_timer);
+}
@@ -0,0 +1,21 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+/* ms between the clock updates of two FHTs */
+#define CLOCKSYNC_SPACING 5000
+
+/*
+ * Sets the clocks of all known FHTs to the local time, every interval
+ * minutes. The first sweep starts a few minutes after the call.
+ */
+int clocksync_start(unsigned int interval);
+void clocksync_stop(void);
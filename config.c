@@ -0,0 +1,114 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "log.h"
+
+#define CONFIG_LINE_MAX 256
+
+static char *config_strip(char *s)
+{
+	char *end;
+
+	s += strspn(s, " \t");
+	end = s + strlen(s);
+	while (end > s && strchr(" \t\r\n", end[-1]))
+		end--;
+	*end = 0;
+
+	return s;
+}
+
+static const struct option *config_option(const struct option *options,
+					  const char *name)
+{
+	for (; options->name; options++)
+		if (!strcmp(options->name, name))
+			return options;
+
+	return NULL;
+}
+
+static int config_line(const struct option *options,
+		       int (*handler)(int opt, const char *arg), char *line)
+{
+	const struct option *option;
+	char *name = line, *arg;
+
+	line[strcspn(line, "#")] = 0;
+
+	arg = strchr(line, '=');
+	if (arg)
+		*arg++ = 0;
+
+	name = config_strip(name);
+	if (!*name)
+		return arg ? -EINVAL : 0;
+
+	option = config_option(options, name);
+	if (!option)
+		return -ENOENT;
+
+	if (arg) {
+		if (option->has_arg == no_argument)
+			return -EINVAL;
+		arg = strdup(config_strip(arg));
+		if (!arg)
+			return -ENOMEM;
+	} else if (option->has_arg == required_argument)
+		return -EINVAL;
+
+	return handler(option->val, arg);
+}
+
+int config_load(const char *path, const struct option *options,
+		int (*handler)(int opt, const char *arg))
+{
+	char line[CONFIG_LINE_MAX];
+	unsigned int lineno = 0;
+	int err = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		err = -errno;
+		error("%s: %s\n", path, strerror(-err));
+		return err;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (!strchr(line, '\n') && !feof(f)) {
+			err = -E2BIG;
+			error("%s:%u: line too long\n", path, lineno);
+			break;
+		}
+
+		err = config_line(options, handler, line);
+		if (err) {
+			error("%s:%u: %s\n", path, lineno, err == -ENOENT ?
+			      "unknown option" : strerror(-err));
+			break;
+		}
+	}
+
+	if (!err && ferror(f))
+		err = -EIO;
+	fclose(f);
+
+	return err;
+}
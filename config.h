@@ -0,0 +1,27 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <getopt.h>
+
+/*
+ * Loads a configuration file, one long option per line, followed by its
+ * argument, if it takes one:
+ *
+ *   serial = /dev/ttyUSB0
+ *   changes-only
+ *
+ * Everything from a '#' to the end of a line is ignored. handler is called
+ * for every option like for those given on the command line; arguments
+ * remain valid until exit.
+ */
+int config_load(const char *path, const struct option *options,
+		int (*handler)(int opt, const char *arg));
@@ -14,89 +14,192 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "fhz.h"
-
-#define FHT_YEAR_BASE 2000
-
-#define FHT_TEMP_OFF 5.5
-#define FHT_TEMP_ON 30.5
-
-#define FHT_IS_VALVE 0x00
-#define FHT_VALVE_1 0x01
-#define FHT_VALVE_2 0x02
-#define FHT_VALVE_3 0x03
-#define FHT_VALVE_4 0x04
-#define FHT_VALVE_5 0x05
-#define FHT_VALVE_6 0x06
-#define FHT_VALVE_7 0x07
-#define FHT_VALVE_8 0x08
-#define FHT_MODE 0x3e
-#define  FHT_MODE_AUTO 0
-#define  FHT_MODE_MANU 1
-#define  FHT_MODE_HOLI 2
-#define FHT_DESIRED_TEMP 0x41
-#define FHT_IS_TEMP_LOW 0x42
-#define FHT_IS_TEMP_HIGH 0x43
-#define FHT_STATUS 0x44
-#define FHT_MANU_TEMP 0x45
-#define FHT_ACK 0x4b
-#define FHT_YEAR 0x60
-#define FHT_MONTH 0x61
-#define FHT_DAY 0x62
-#define FHT_HOUR 0x63
-#define FHT_MINUTE 0x64
-#define FHT_ACK2 0x69
-#define FHT_START_XMIT 0x7d
-#define FHT_END_XMIT 0x7e
-#define FHT_DAY_TEMP 0x82
-#define FHT_NIGHT_TEMP 0x84
-#define FHT_WINDOW_OPEN_TEMP 0x8a
-
-#define __report_printf(__message, __no, __field, ...) \
-	snprintf(__message->report[__no].__field, \
-		 sizeof(__message->report[__no].__field), \
-		 __VA_ARGS__)
-
-#define report_printf_topic(__message, __no, ...) \
-	__report_printf(__message, __no, topic, __VA_ARGS__)
-
-#define report_printf_value(__message, __no, ...) \
-	__report_printf(__message, __no, value, __VA_ARGS__)
-
-struct fht_message_raw {
-	unsigned char cmd;
-	unsigned char subfun;
-	unsigned char status;
-	unsigned char value;
+#include "txq.h"
+
+/* in 1/1000 °C */
+#define FHT_TEMP_OFF 5500
+#define FHT_TEMP_ON 30500
+
+/* reports are formatted straight into the caller's buffers */
+struct fht_report {
+	char *topic;
+	size_t topic_size;
+	char *value;
+	size_t value_size;
 };
 
+#define report_printf_topic(__report, ...) \
+	snprintf((__report)->topic, (__report)->topic_size, __VA_ARGS__)
+
+#define report_printf_value(__report, ...) \
+	snprintf((__report)->value, (__report)->value_size, __VA_ARGS__)
+
 struct fht_command {
 	unsigned char function_id;
 	const char *name;
+	/* largest valid value, 0 if all values are valid */
+	unsigned char max;
+	/* number of reports a frame results in, defaults to one */
+	unsigned char reports;
 	int (*input_conversion)(const char *payload);
-	int (*output_conversion)(struct fht_message *message,
-				 const struct fht_message_raw *raw);
+	/*
+	 * optional, validates a frame and tracks state of the device. Called
+	 * by fht_update(), from the main thread only.
+	 */
+	int (*decode)(struct fht_message *message, struct fht_device *device);
+	/* formats report n of a message, returns the length of the value */
+	int (*output_conversion)(const struct fht_message *message,
+				 unsigned int n, struct fht_report *report);
 };
 
-#define for_each_fht_command(commands, command, counter) \
-	for((counter) = 0, (command) = (commands); \
-	    (counter) < ARRAY_SIZE((commands)); \
-	    (counter)++, (command)++)
+/*
+ * Values are converted without floats and the C library's locale dependent
+ * printf and scanf, but produce the same output as the former "%0.1f" and
+ * "%0.2f" formats.
+ */
+static const char digit_pairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233"
+	"34353637383940414243444546474849505152535455565758596061626364656667"
+	"6869707172737475767778798081828384858687888990919293949596979899";
+
+/* writes value in decimal to buffer, which must hold 5 digits */
+static unsigned int fmt_uint(char *buffer, unsigned int value)
+{
+	char tmp[6], *pos = tmp + sizeof(tmp);
+	unsigned int len;
+
+	while (value >= 100) {
+		pos -= 2;
+		memcpy(pos, digit_pairs + (value % 100) * 2, 2);
+		value /= 100;
+	}
+	if (value >= 10) {
+		pos -= 2;
+		memcpy(pos, digit_pairs + value * 2, 2);
+	} else
+		*--pos = '0' + value;
+
+	len = tmp + sizeof(tmp) - pos;
+	memcpy(buffer, pos, len);
+
+	return len;
+}
+
+/* formats value / 10^decimals, with decimals being one or two */
+static int report_fixed(struct fht_report *report, unsigned int value,
+			unsigned int decimals)
+{
+	char buffer[16];
+	unsigned int len, scale = decimals == 2 ? 100 : 10;
+
+	len = fmt_uint(buffer, value / scale);
+	buffer[len++] = '.';
+	if (decimals == 2) {
+		memcpy(buffer + len, digit_pairs + (value % 100) * 2, 2);
+		len += 2;
+	} else
+		buffer[len++] = '0' + value % 10;
+
+	if (len >= report->value_size)
+		return -ENOSPC;
+	memcpy(report->value, buffer, len);
+	report->value[len] = 0;
+
+	return len;
+}
+
+static int report_uint(struct fht_report *report, unsigned int value)
+{
+	char buffer[16];
+	unsigned int len;
+
+	len = fmt_uint(buffer, value);
+	if (len >= report->value_size)
+		return -ENOSPC;
+	memcpy(report->value, buffer, len);
+	report->value[len] = 0;
+
+	return len;
+}
+
+/* accepts surrounding whitespace, like sscanf did, but no trailing garbage */
+static int parse_uint(const char *payload, unsigned int *value)
+{
+	unsigned int digits = 0;
+
+	*value = 0;
+	while (isspace((unsigned char)*payload))
+		payload++;
+	for (; isdigit((unsigned char)*payload); payload++) {
+		if (*value > 9999)
+			return -ERANGE;
+		*value = *value * 10 + *payload - '0';
+		digits++;
+	}
+	while (isspace((unsigned char)*payload))
+		payload++;
+
+	return digits && !*payload ? 0 : -EINVAL;
+}
+
+/*
+ * Parses a decimal number to 1/1000. excess is set if further non-zero
+ * decimals were cut off.
+ */
+static int parse_milli(const char *payload, unsigned int *value, bool *excess)
+{
+	unsigned int integer, scale = 100, digits = 0;
+	const char *pos;
+
+	*value = 0;
+	*excess = false;
+
+	while (isspace((unsigned char)*payload))
+		payload++;
+	if (*payload == '+')
+		payload++;
+
+	for (pos = payload, integer = 0; isdigit((unsigned char)*pos); pos++) {
+		if (integer > 9999)
+			return -ERANGE;
+		integer = integer * 10 + *pos - '0';
+		digits++;
+	}
+	*value = integer * 1000;
+
+	if (*pos == '.')
+		for (pos++; isdigit((unsigned char)*pos); pos++) {
+			if (scale)
+				*value += (*pos - '0') * scale;
+			else if (*pos != '0')
+				*excess = true;
+			scale /= 10;
+			digits++;
+		}
+
+	while (isspace((unsigned char)*pos))
+		pos++;
+
+	return digits && !*pos ? 0 : -EINVAL;
+}
 
 static const char s_mode_auto[] = "auto";
 static const char s_mode_holiday[] = "holiday";
 static const char s_mode_manual[] = "manual";
 
-static unsigned char temp_low;
-
 static int payload_to_fht_temp(const char *payload)
 {
-	float temp;
+	unsigned int temp;
+	bool excess;
+	int err;
 
 	if (!strcasecmp(payload, "off")) {
 		temp = FHT_TEMP_OFF;
@@ -104,21 +207,25 @@ static int payload_to_fht_temp(const char *payload)
 	} else if (!strcasecmp(payload, "on")) {
 		temp = FHT_TEMP_ON;
 		goto temp_out;
-	} else if (sscanf(payload, "%f", &temp) != 1)
-		return -EINVAL;
+	}
+
+	err = parse_milli(payload, &temp, &excess);
+	if (err)
+		return err;
 
-	if (temp < FHT_TEMP_OFF || temp > FHT_TEMP_ON)
+	if (temp < FHT_TEMP_OFF || temp > FHT_TEMP_ON ||
+	    (temp == FHT_TEMP_ON && excess))
 		return -ERANGE;
 
 temp_out:
-	return (unsigned char)(temp/0.5);
+	/* the FHT counts in 0.5 °C, round down */
+	return temp / 500;
 }
 
-static int fht_temp_to_str(struct fht_message *message,
-			   const struct fht_message_raw *raw)
+static int fht_temp_to_str(const struct fht_message *message,
+			   unsigned int n, struct fht_report *report)
 {
-	report_printf_value(message, 0, "%0.1f", (float)raw->value * 0.5);
-	return 0;
+	return report_fixed(report, message->value * 5, 1);
 }
 
 static int payload_to_mode(const char *payload)
@@ -127,19 +234,18 @@ static int payload_to_mode(const char *payload)
 		return FHT_MODE_AUTO;
 	if (!strcasecmp(payload, s_mode_manual))
 		return FHT_MODE_MANU;
-	if (!strcasecmp(payload, s_mode_manual))
+	if (!strcasecmp(payload, s_mode_holiday))
 		return FHT_MODE_HOLI;
 
 	return -EINVAL;
 }
 
-static int mode_to_str(struct fht_message *message,
-		       const struct fht_message_raw *raw)
+static int mode_to_str(const struct fht_message *message, unsigned int n,
+		       struct fht_report *report)
 {
 	const char *src;
-	int err = 0;
 
-	switch (raw->value) {
+	switch (message->value) {
 	case FHT_MODE_AUTO:
 		src = s_mode_auto;
 		break;
@@ -151,13 +257,79 @@ static int mode_to_str(struct fht_message *message,
 		break;
 	default:
 		src = "unknown";
-		err = -EINVAL;
 		break;
 	}
 
-	report_printf_value(message, 0, src);
+	return report_printf_value(report, "%s", src);
+}
 
-	return err;
+/* parses "HH:MM" in steps of 10 minutes, up to 24:00 */
+static int parse_fht_time(const char **payload)
+{
+	const char *pos = *payload;
+	unsigned int hour = 0, minute;
+
+	if (!isdigit((unsigned char)*pos))
+		return -EINVAL;
+	hour = *pos++ - '0';
+	if (isdigit((unsigned char)*pos))
+		hour = hour * 10 + *pos++ - '0';
+
+	if (*pos++ != ':' || !isdigit((unsigned char)pos[0]) ||
+	    !isdigit((unsigned char)pos[1]))
+		return -EINVAL;
+	minute = (pos[0] - '0') * 10 + pos[1] - '0';
+	*payload = pos + 2;
+
+	if (minute > 59 || minute % 10 || hour * 6 + minute / 10 > 144)
+		return -ERANGE;
+
+	return hour * 6 + minute / 10;
+}
+
+static int payload_to_fht_time(const char *payload)
+{
+	int time;
+
+	while (isspace((unsigned char)*payload))
+		payload++;
+	if (!strcasecmp(payload, "off"))
+		return FHT_PROGRAM_OFF;
+
+	time = parse_fht_time(&payload);
+	if (time < 0)
+		return time;
+
+	while (isspace((unsigned char)*payload))
+		payload++;
+
+	return *payload ? -EINVAL : time;
+}
+
+/* writes the five characters of "HH:MM" */
+static void fmt_fht_time(char *buffer, unsigned char value)
+{
+	memcpy(buffer, digit_pairs + (value / 6) * 2, 2);
+	buffer[2] = ':';
+	buffer[3] = '0' + (value % 6);
+	buffer[4] = '0';
+}
+
+static int fht_time_to_str(const struct fht_message *message, unsigned int n,
+			   struct fht_report *report)
+{
+	if (report->value_size < 6)
+		return -ENOSPC;
+	fmt_fht_time(report->value, message->value);
+	report->value[5] = 0;
+
+	return 5;
+}
+
+/* any payload requests the full report */
+static int payload_to_report(const char *payload)
+{
+	return FHT_REPORT_ALL;
 }
 
 static int input_not_accepted(const char *payload)
@@ -166,43 +338,61 @@ static int input_not_accepted(const char *payload)
 }
 
 static int fht_is_temp_low(struct fht_message *message,
-			   const struct fht_message_raw *raw)
+			   struct fht_device *device)
 {
-	temp_low = raw->value;
+	device->temp_low = message->value;
+	device->temp_low_pending = true;
 	return -EAGAIN;
 }
 
-static int fht_is_temp_high_to_str(struct fht_message *message,
-				   const struct fht_message_raw *raw)
+static int fht_is_temp_high(struct fht_message *message,
+			    struct fht_device *device)
 {
-	report_printf_value(message, 0, "%0.2f",
-			    ((float)temp_low + (float)raw->value* 256)/10.0);
+	/* never combine the high byte with a stale or foreign low byte */
+	if (!device->temp_low_pending)
+		return -EAGAIN;
+	device->temp_low_pending = false;
+
+	message->value = device->temp_low | message->value << 8;
 	return 0;
 }
 
+static int fht_is_temp_to_str(const struct fht_message *message,
+			      unsigned int n, struct fht_report *report)
+{
+	/* reported in 0.1 °C, but published with two decimals */
+	return report_fixed(report, message->value * 10, 2);
+}
+
 static int payload_to_fht_year(const char *payload)
 {
 	unsigned int year;
+	int err;
 
-	if (sscanf(payload, "%u", &year) != 1)
-		return -EINVAL;
+	err = parse_uint(payload, &year);
+	if (err)
+		return err;
+
+	if (year < FHT_YEAR_BASE || year > FHT_YEAR_BASE + 0xff)
+		return -ERANGE;
 
 	return year - FHT_YEAR_BASE;
 }
 
-static int fht_year_to_str(struct fht_message *message,
-			   const struct fht_message_raw *raw)
+static int fht_year_to_str(const struct fht_message *message,
+			   unsigned int n, struct fht_report *report)
 {
-	report_printf_value(message, 0, "%u", FHT_YEAR_BASE + raw->value);
-	return 0;
+	return report_uint(report, FHT_YEAR_BASE + message->value);
 }
 
 static int payload_to_fht_month(const char *payload)
 {
 	unsigned int month;
+	int err;
 
-	if (sscanf(payload, "%u", &month) != 1)
-		return -EINVAL;
+	err = parse_uint(payload, &month);
+	if (err)
+		return err;
 
 	if (month > 12)
 		return -EINVAL;
@@ -210,22 +400,14 @@ static int payload_to_fht_month(const char *payload)
 	return month;
 }
 
-static int fht_month_to_str(struct fht_message *message,
-			   const struct fht_message_raw *raw)
-{
-	if (raw->value > 12)
-		return -EINVAL;
-
-	report_printf_value(message, 0, "%u", raw->value);
-	return 0;
-}
-
 static int payload_to_fht_day(const char *payload)
 {
 	unsigned int day;
+	int err;
 
-	if (sscanf(payload, "%u", &day) != 1)
-		return -EINVAL;
+	err = parse_uint(payload, &day);
+	if (err)
+		return err;
 
 	if (day > 31)
 		return -EINVAL;
@@ -233,22 +415,14 @@ static int payload_to_fht_day(const char *payload)
 	return day;
 }
 
-static int fht_day_to_str(struct fht_message *message,
-			  const struct fht_message_raw *raw)
-{
-	if (raw->value > 31)
-		return -EINVAL;
-
-	report_printf_value(message, 0, "%u", raw->value);
-	return 0;
-}
-
 static int payload_to_fht_hour(const char *payload)
 {
 	unsigned int hour;
+	int err;
 
-	if (sscanf(payload, "%u", &hour) != 1)
-		return -EINVAL;
+	err = parse_uint(payload, &hour);
+	if (err)
+		return err;
 
 	if (hour > 24)
 		return -EINVAL;
@@ -256,22 +430,14 @@ static int payload_to_fht_hour(const char *payload)
 	return hour;
 }
 
-static int fht_hour_to_str(struct fht_message *message,
-			   const struct fht_message_raw *raw)
-{
-	if (raw->value > 24)
-		return -EINVAL;
-
-	report_printf_value(message, 0, "%u", raw->value);
-	return 0;
-}
-
 static int payload_to_fht_minute(const char *payload)
 {
 	unsigned int minute;
+	int err;
 
-	if (sscanf(payload, "%u", &minute) != 1)
-		return -EINVAL;
+	err = parse_uint(payload, &minute);
+	if (err)
+		return err;
 
 	if (minute > 59)
 		return -EINVAL;
@@ -279,24 +445,27 @@ static int payload_to_fht_minute(const char *payload)
 	return minute;
 }
 
-static int fht_minute_to_str(struct fht_message *message,
-			     const struct fht_message_raw *raw)
+/* the clock of the FHT is known as of now, see clocksync.c */
+static int fht_minute(struct fht_message *message, struct fht_device *device)
 {
-	if (raw->value > 59)
-		return -EINVAL;
-
-	report_printf_value(message, 0, "%u", raw->value);
+	device->clock_reported = time(NULL);
 	return 0;
 }
 
-static int fht_percentage_to_str(struct fht_message *message,
-				 const struct fht_message_raw *raw)
+/* month, day, hour and minute, ranges are checked by fht_decode() */
+static int fht_uint_to_str(const struct fht_message *message,
+			   unsigned int n, struct fht_report *report)
+{
+	return report_uint(report, message->value);
+}
+
+static int fht_percentage(struct fht_message *message,
+			  struct fht_device *device)
 {
 	unsigned char l, r;
-	unsigned char valve = raw->value;
 
-	l = (raw->status >> 4) & 0x0f;
-	r = raw->status & 0x0f;
+	l = (message->status >> 4) & 0x0f;
+	r = message->status & 0x0f;
 
 	/* actuator changed state. e.g., the valve */
 	if (l == 0x2) {
@@ -306,20 +475,10 @@ static int fht_percentage_to_str(struct fht_message *message,
 
 	switch (r) {
 	case 0x1: /* 30.5 or ON on fht80b */
-		valve = 0xff;
+		message->value = 0xff;
 		break;
 	case 0x2: /* 5.5 or OFF on fht80b */
-		valve = 0;
-		break;
-	case 0x0: /* value contains valve state */
-	case 0x6:
-		break;
-	case 0x8: /* value contains OFFSET setting */
-		report_printf_topic(message, 0, "valve/%u/offset", raw->cmd);
-		report_printf_value(message, 0, "%s%u",
-				    raw->value & 0x80 ? "-" : "",
-				    raw->value & 0x7f);
-		return 0;
+		message->value = 0;
 		break;
 	case 0xa: /* lime-protection */
 		/* lime-protection bug, value contains valve setting */
@@ -329,65 +488,109 @@ static int fht_percentage_to_str(struct fht_message *message,
 		return -EINVAL;
 		/* TBD: submit lime-protection */
 		break;
-	case 0xc: /* synctime */
-		report_printf_topic(message, 0, "synctime");
-		report_printf_value(message, 0, "%u", (raw->value / 2) - 1);
-		return 0;
-		break;
 	case 0xe: /* TEST */
 		return -EINVAL;
 		break;
 	case 0xf: /* pair */
-		report_printf_topic(message, 1, "valve/%u", raw->cmd);
-		report_printf_value(message, 1, "paired");
+		device->paired_valves |= 1 << message->function_id;
+		message->reports = 2;
 		break;
 	}
 
-	report_printf_value(message, 0, "%0.1f", (float)valve * 100 / 255);
 	return 0;
 }
 
-static int fht_status_to_str(struct fht_message *message,
-			     const struct fht_message_raw *raw)
+static int fht_percentage_to_str(const struct fht_message *message,
+				 unsigned int n, struct fht_report *report)
 {
-	report_printf_topic(message, 0, "window");
-	report_printf_value(message, 0, "%s",
-			    raw->value & (1 << 5) ? "open" : "close");
+	switch (message->status & 0x0f) {
+	case 0x8: /* value contains OFFSET setting */
+		report_printf_topic(report, "valve/%u/offset",
+				    message->function_id);
+		return report_printf_value(report, "%s%u",
+					   message->value & 0x80 ? "-" : "",
+					   message->value & 0x7f);
+	case 0xc: /* synctime */
+		report_printf_topic(report, "synctime");
+		return report_printf_value(report, "%u",
+					   (message->value / 2) - 1);
+	case 0xf: /* pair */
+		if (n == 1) {
+			report_printf_topic(report, "valve/%u",
+					    message->function_id);
+			return report_printf_value(report, "paired");
+		}
+		break;
+	}
 
-	report_printf_topic(message, 1, "battery");
-	report_printf_value(message, 1, "%s",
-			    raw->value & (1 << 0) ? "empty" : "ok");
-	return 0;
+	/*
+	 * 0..255 to percent in 0.1, rounded to nearest. 200 * value / 51 is
+	 * never exactly halfway, so this matches rounding the float.
+	 */
+	return report_fixed(report, (message->value * 200 + 25) / 51, 1);
+}
+
+static int fht_status_to_str(const struct fht_message *message,
+			     unsigned int n, struct fht_report *report)
+{
+	if (n == 0) {
+		report_printf_topic(report, "window");
+		return report_printf_value(report, "%s",
+					   message->value & (1 << 5) ?
+					   "open" : "close");
+	}
+
+	report_printf_topic(report, "battery");
+	return report_printf_value(report, "%s",
+				   message->value & (1 << 0) ? "empty" : "ok");
 }
 
-static int fht_ignore(struct fht_message *message,
-		      const struct fht_message_raw *raw)
+static int fht_ignore(struct fht_message *message, struct fht_device *device)
 {
-	printf("ignored %02x: %02x %02x %02x\n", raw->cmd, raw->subfun,
-	       raw->status, raw->value);
+	debug("ignored %02x: %02x %02x %02x\n", message->function_id,
+	      message->subfun, message->status, message->value);
+	message->reports = 0;
 	return 0;
 }
 
 #define DEFINE_VALVE(__no) \
-	{ \
+	[FHT_VALVE_##__no] = { \
 		.function_id = FHT_VALVE_##__no, \
 		.name = "valve/" __stringify(__no), \
 		.input_conversion = input_not_accepted, \
+		.decode = fht_percentage, \
 		.output_conversion = fht_percentage_to_str, \
 	}
 
+#define DEFINE_PROGRAM(__reg, __name) \
+	[__reg] = { \
+		.function_id = __reg, \
+		.name = __name, \
+		.max = FHT_PROGRAM_OFF, \
+		.input_conversion = payload_to_fht_time, \
+		.output_conversion = fht_time_to_str, \
+	}
+
+#define DEFINE_PROGRAM_DAY(__day, __name) \
+	DEFINE_PROGRAM(FHT_PROGRAM_REG(__day, 0), __name "-from1"), \
+	DEFINE_PROGRAM(FHT_PROGRAM_REG(__day, 1), __name "-to1"), \
+	DEFINE_PROGRAM(FHT_PROGRAM_REG(__day, 2), __name "-from2"), \
+	DEFINE_PROGRAM(FHT_PROGRAM_REG(__day, 3), __name "-to2")
+
 #define DEFINE_IGNORE(__no) \
-	{ \
+	[__no] = { \
 		.function_id = __no, \
 		.input_conversion = input_not_accepted, \
-		.output_conversion = fht_ignore, \
+		.decode = fht_ignore, \
 	}
 
-static const struct fht_command fht_commands[] = {
-	/* is valve */ {
+/* indexed by function_id, holes have neither decode nor output_conversion */
+static const struct fht_command fht_commands[256] = {
+	/* is valve */ [FHT_IS_VALVE] = {
 		.function_id = FHT_IS_VALVE,
 		.name = "is-valve",
 		.input_conversion = input_not_accepted,
+		.decode = fht_percentage,
 		.output_conversion = fht_percentage_to_str,
 	},
 	DEFINE_VALVE(1),
@@ -398,36 +601,46 @@ static const struct fht_command fht_commands[] = {
 	DEFINE_VALVE(6),
 	DEFINE_VALVE(7),
 	DEFINE_VALVE(8),
-	/* mode */ {
+	DEFINE_PROGRAM_DAY(0, "mon"),
+	DEFINE_PROGRAM_DAY(1, "tue"),
+	DEFINE_PROGRAM_DAY(2, "wed"),
+	DEFINE_PROGRAM_DAY(3, "thu"),
+	DEFINE_PROGRAM_DAY(4, "fri"),
+	DEFINE_PROGRAM_DAY(5, "sat"),
+	DEFINE_PROGRAM_DAY(6, "sun"),
+	/* mode */ [FHT_MODE] = {
 		.function_id = FHT_MODE,
 		.name = "mode",
+		.max = FHT_MODE_HOLI,
 		.input_conversion = payload_to_mode,
 		.output_conversion = mode_to_str,
 	},
-	/* desired temp */ {
+	/* desired temp */ [FHT_DESIRED_TEMP] = {
 		.function_id = FHT_DESIRED_TEMP,
 		.name = "desired-temp",
 		.input_conversion = payload_to_fht_temp,
 		.output_conversion = fht_temp_to_str,
 	},
-	/* is temp low */ {
+	/* is temp low */ [FHT_IS_TEMP_LOW] = {
 		.function_id = FHT_IS_TEMP_LOW,
 		.input_conversion = input_not_accepted,
-		.output_conversion = fht_is_temp_low,
+		.decode = fht_is_temp_low,
 	},
-	/* is temp high */ {
+	/* is temp high */ [FHT_IS_TEMP_HIGH] = {
 		.function_id = FHT_IS_TEMP_HIGH,
 		.name = "is-temp",
 		.input_conversion = input_not_accepted,
-		.output_conversion = fht_is_temp_high_to_str,
+		.decode = fht_is_temp_high,
+		.output_conversion = fht_is_temp_to_str,
 	},
-	/* status */ {
+	/* status */ [FHT_STATUS] = {
 		.function_id = FHT_STATUS,
 		.name = "status",
+		.reports = 2,
 		.input_conversion = input_not_accepted,
 		.output_conversion = fht_status_to_str,
 	},
-	/* manu temp */ {
+	/* manu temp */ [FHT_MANU_TEMP] = {
 		.function_id = FHT_MANU_TEMP,
 		.name = "manu-temp",
 		.input_conversion = payload_to_fht_temp,
@@ -435,52 +648,69 @@ static const struct fht_command fht_commands[] = {
 	},
 	/* ack, ack2, {start,end}-xmit, we don't forward this */
 	DEFINE_IGNORE(FHT_ACK),
-	/* year */ {
+	/* year */ [FHT_YEAR] = {
 		.function_id = FHT_YEAR,
 		.name = "year",
 		.input_conversion = payload_to_fht_year,
 		.output_conversion = fht_year_to_str,
 	},
-	/* month */ {
+	/* month */ [FHT_MONTH] = {
 		.function_id = FHT_MONTH,
 		.name = "month",
+		.max = 12,
 		.input_conversion = payload_to_fht_month,
-		.output_conversion = fht_month_to_str,
+		.output_conversion = fht_uint_to_str,
 	},
-	/* day */ {
+	/* day */ [FHT_DAY] = {
 		.function_id = FHT_DAY,
 		.name = "day",
+		.max = 31,
 		.input_conversion = payload_to_fht_day,
-		.output_conversion = fht_day_to_str,
+		.output_conversion = fht_uint_to_str,
 	},
-	/* hour */ {
+	/* hour */ [FHT_HOUR] = {
 		.function_id = FHT_HOUR,
 		.name = "hour",
+		.max = 24,
 		.input_conversion = payload_to_fht_hour,
-		.output_conversion = fht_hour_to_str,
+		.output_conversion = fht_uint_to_str,
 	},
-	/* minute */ {
+	/* minute */ [FHT_MINUTE] = {
 		.function_id = FHT_MINUTE,
 		.name = "minute",
+		.max = 59,
 		.input_conversion = payload_to_fht_minute,
-		.output_conversion = fht_minute_to_str,
+		.decode = fht_minute,
+		.output_conversion = fht_uint_to_str,
+	},
+	/* report1 */ [FHT_REPORT1] = {
+		.function_id = FHT_REPORT1,
+		.name = "report1",
+		.input_conversion = payload_to_report,
+		.output_conversion = fht_uint_to_str,
+	},
+	/* report2 */ [FHT_REPORT2] = {
+		.function_id = FHT_REPORT2,
+		.name = "report2",
+		.input_conversion = payload_to_report,
+		.output_conversion = fht_uint_to_str,
 	},
 	DEFINE_IGNORE(FHT_ACK2),
 	DEFINE_IGNORE(FHT_START_XMIT),
 	DEFINE_IGNORE(FHT_END_XMIT),
-	/* day temp */ {
+	/* day temp */ [FHT_DAY_TEMP] = {
 		.function_id = FHT_DAY_TEMP,
 		.name = "day-temp",
 		.input_conversion = payload_to_fht_temp,
 		.output_conversion = fht_temp_to_str,
 	},
-	/* night temp */ {
+	/* night temp */ [FHT_NIGHT_TEMP] = {
 		.function_id = FHT_NIGHT_TEMP,
 		.name = "night-temp",
 		.input_conversion = payload_to_fht_temp,
 		.output_conversion = fht_temp_to_str,
 	},
-	/* window open temp */ {
+	/* window open temp */ [FHT_WINDOW_OPEN_TEMP] = {
 		.function_id = FHT_WINDOW_OPEN_TEMP,
 		.name = "window-open-temp",
 		.input_conversion = payload_to_fht_temp,
@@ -488,76 +718,200 @@ static const struct fht_command fht_commands[] = {
 	},
 };
 
-int fht_decode(const struct payload *payload, struct fht_message *message)
+/* the from1, from2, to1, to2 registers of a day, in the order of their names */
+#define PROGRAM_NAMES(__day) \
+	FHT_PROGRAM_REG(__day, 0), \
+	FHT_PROGRAM_REG(__day, 2), \
+	FHT_PROGRAM_REG(__day, 1), \
+	FHT_PROGRAM_REG(__day, 3)
+
+/* function_ids of all named commands, sorted by name for bsearch() */
+static const unsigned char fht_command_names[] = {
+	FHT_DAY,
+	FHT_DAY_TEMP,
+	FHT_DESIRED_TEMP,
+	PROGRAM_NAMES(4), /* fri */
+	FHT_HOUR,
+	FHT_IS_TEMP_HIGH,
+	FHT_IS_VALVE,
+	FHT_MANU_TEMP,
+	FHT_MINUTE,
+	FHT_MODE,
+	PROGRAM_NAMES(0), /* mon */
+	FHT_MONTH,
+	FHT_NIGHT_TEMP,
+	FHT_REPORT1,
+	FHT_REPORT2,
+	PROGRAM_NAMES(5), /* sat */
+	FHT_STATUS,
+	PROGRAM_NAMES(6), /* sun */
+	PROGRAM_NAMES(3), /* thu */
+	PROGRAM_NAMES(1), /* tue */
+	FHT_VALVE_1,
+	FHT_VALVE_2,
+	FHT_VALVE_3,
+	FHT_VALVE_4,
+	FHT_VALVE_5,
+	FHT_VALVE_6,
+	FHT_VALVE_7,
+	FHT_VALVE_8,
+	PROGRAM_NAMES(2), /* wed */
+	FHT_WINDOW_OPEN_TEMP,
+	FHT_YEAR,
+};
+
+static int fht_command_name_cmp(const void *key, const void *entry)
+{
+	return strcmp(key, fht_commands[*(const unsigned char *)entry].name);
+}
+
+int fht_command_id(const char *name)
+{
+	const unsigned char *function_id;
+
+	function_id = bsearch(name, fht_command_names,
+			      ARRAY_SIZE(fht_command_names),
+			      sizeof(fht_command_names[0]),
+			      fht_command_name_cmp);
+	if (!function_id)
+		return -EINVAL;
+
+	return *function_id;
+}
+
+static int fht_decode_command(struct fht_message *message)
+{
+	const struct fht_command *fht_command;
+
+	fht_command = &fht_commands[message->function_id];
+	if (!fht_command->decode && !fht_command->output_conversion)
+		return -EINVAL;
+
+	if (fht_command->max && message->value > fht_command->max)
+		return -EINVAL;
+
+	message->reports = fht_command->reports ? : 1;
+
+	return 0;
+}
+
+int fht_decode(const struct fhz_frame *frame, struct fht_message *message)
 {
 	static const unsigned char magic_ack[] = {0x83, 0x09, 0x83, 0x01};
 	static const unsigned char magic_status[] = {0x09, 0x09, 0xa0, 0x01};
-	struct fht_message_raw fht_message_raw = {0, 0, 0, 0};
-	const struct fht_command *fht_command;
-	int i;
+	int err;
 
 	memset(message, 0, sizeof(*message));
 
-	if (payload->len < 9)
-		return -EINVAL;
+	if (frame->len < 9)
+		goto unknown_out;
 
-	if (!memcmp(payload->data, magic_ack, sizeof(magic_ack))) {
+	if (!memcmp(frame->data, magic_ack, sizeof(magic_ack))) {
 		message->type = ACK;
-		fht_message_raw.value = payload->data[7];
-	} else if (!memcmp(payload->data, magic_status, sizeof(magic_status))) {
-		if (payload->len != 10)
-			return -EINVAL;
+		message->value = frame->data[7];
+	} else if (!memcmp(frame->data, magic_status, sizeof(magic_status))) {
+		if (frame->len != 10)
+			goto unknown_out;
 		message->type = STATUS;
-		fht_message_raw.subfun = payload->data[7];
-		fht_message_raw.status = payload->data[8];
-		fht_message_raw.value = payload->data[9];
+		message->subfun = frame->data[7];
+		message->status = frame->data[8];
+		message->value = frame->data[9];
 	} else
-		return -EINVAL;
-	fht_message_raw.cmd = payload->data[6];
+		goto unknown_out;
+	message->function_id = frame->data[6];
 
-	message->hauscode = *(const struct hauscode*)(payload->data + 4);
+	message->hauscode.upper = frame->data[4];
+	message->hauscode.lower = frame->data[5];
 
-	for_each_fht_command(fht_commands, fht_command, i) {
-		if (fht_command->function_id != fht_message_raw.cmd)
-			continue;
-		if (fht_command->name)
-			strncpy(message->report[0].topic, fht_command->name,
-				sizeof(message->report[0].topic));
-		return fht_command->output_conversion(message,
-						      &fht_message_raw);
-	}
+	err = fht_decode_command(message);
+	if (err)
+		metric_decode_error(message->function_id, err);
+
+	return err;
 
+unknown_out:
+	metric_inc(METRIC_DECODE_UNKNOWN);
 	return -EINVAL;
 }
 
-static int fht_send(int fd, const struct hauscode *hauscode,
-		    unsigned char memory, unsigned char value)
+int fht_update(struct fht_message *message, unsigned char port)
+{
+	const struct fht_command *fht_command;
+	struct fht_device *device;
+	int err;
+
+	device = fht_device_get(&message->hauscode);
+	if (!device)
+		return -ENOSPC;
+	/* the value is still the one of the frame */
+	fht_device_update(device, message->function_id, message->value);
+	device->port = port;
+
+	fht_command = &fht_commands[message->function_id];
+	if (!fht_command->decode)
+		return 0;
+
+	err = fht_command->decode(message, device);
+	if (err)
+		metric_decode_error(message->function_id, err);
+
+	return err;
+}
+
+int fht_format_report(const struct fht_message *message, unsigned int n,
+		      char *topic, size_t topic_size,
+		      char *value, size_t value_size)
 {
-	const struct payload payload = {
+	const struct fht_command *fht_command;
+	struct fht_report report = {
+		.topic = topic,
+		.topic_size = topic_size,
+		.value = value,
+		.value_size = value_size,
+	};
+
+	fht_command = &fht_commands[message->function_id];
+	if (n >= message->reports || !fht_command->output_conversion)
+		return -ENOENT;
+
+	if (fht_command->name)
+		report_printf_topic(&report, "%s", fht_command->name);
+	else
+		topic[0] = 0;
+
+	return fht_command->output_conversion(message, n, &report);
+}
+
+int fht_send(struct fhz *fhz, const struct hauscode *hauscode,
+	     const struct fht_command_value *commands, unsigned int n)
+{
+	struct payload payload = {
 		.tt = 0x04,
-		.len = 7,
-		.data = {0x02, 0x01, 0x83, hauscode->upper, hauscode->lower,
-			 memory, value},
+		.len = 5,
+		.data = {0x02, 0x01, 0x83, hauscode->upper, hauscode->lower},
 	};
+	unsigned int i;
+
+	if (n > FHT_MAX_COMMANDS)
+		return -EINVAL;
 
-	return fhz_send(fd, &payload);
+	for (i = 0; i < n; i++) {
+		payload.data[payload.len++] = commands[i].function_id;
+		payload.data[payload.len++] = commands[i].value;
+	}
+
+	return fhz_send(fhz, &payload);
 }
 
-int fht_set(int fd, const struct hauscode *hauscode,
-	    const char *command, const char *payload)
+int fht_set(const struct hauscode *hauscode, unsigned char function_id,
+	    const char *payload, const char *id, int priority)
 {
-	const struct fht_command *fht_command;
+	const struct fht_command *fht_command = &fht_commands[function_id];
 	unsigned char fht_val;
-	bool found = false;
-	int i, err;
-
-	for_each_fht_command(fht_commands, fht_command, i)
-		if (fht_command->name && !strcmp(fht_command->name, command)) {
-			found = true;
-			break;
-		}
+	struct fhz *fhz;
+	int err;
 
-	if (!found)
+	if (!fht_command->input_conversion)
 		return -EINVAL;
 
 	err = fht_command->input_conversion(payload);
@@ -566,5 +920,214 @@ int fht_set(int fd, const struct hauscode *hauscode,
 
 	fht_val = err;
 
-	return fht_send(fd, hauscode, fht_command->function_id, fht_val);
+	/* setting the clock and refreshing reports are bulk work */
+	if (priority == TXQ_PRIO_DEFAULT)
+		priority = fht_command->function_id >= FHT_YEAR &&
+			   fht_command->function_id <= FHT_REPORT2 ?
+			   TXQ_PRIO_LOW : TXQ_PRIO_HIGH;
+
+	fhz = fhz_route(hauscode);
+	if (!fhz || !fhz->txq)
+		return -ENODEV;
+
+	return txq_push(fhz->txq, hauscode, fht_command->function_id, fht_val,
+			priority, id);
+}
+
+static const char fht_program_days[FHT_PROGRAM_DAYS][4] = {
+	"mon", "tue", "wed", "thu", "fri", "sat", "sun",
+};
+
+static const char *json_skip(const char *pos)
+{
+	while (isspace((unsigned char)*pos))
+		pos++;
+	return pos;
+}
+
+/* parses ["HH:MM-HH:MM", ...] into the four registers of a day */
+static int fht_program_parse_day(const char **payload, unsigned char *regs)
+{
+	const char *pos = json_skip(*payload);
+	unsigned int period;
+	int from, to;
+
+	if (*pos++ != '[')
+		return -EINVAL;
+
+	/* periods that aren't given are unused */
+	memset(regs, FHT_PROGRAM_OFF, 4);
+
+	pos = json_skip(pos);
+	for (period = 0; *pos != ']'; period++) {
+		if (period == 2)
+			return -ERANGE;
+		if (*pos++ != '"')
+			return -EINVAL;
+
+		from = parse_fht_time(&pos);
+		if (from < 0)
+			return from;
+		if (*pos++ != '-')
+			return -EINVAL;
+		to = parse_fht_time(&pos);
+		if (to < 0)
+			return to;
+		if (*pos++ != '"')
+			return -EINVAL;
+		if (from > to)
+			return -ERANGE;
+
+		regs[period * 2] = from;
+		regs[period * 2 + 1] = to;
+
+		pos = json_skip(pos);
+		if (*pos == ',')
+			pos = json_skip(pos + 1);
+		else if (*pos != ']')
+			return -EINVAL;
+	}
+
+	*payload = pos + 1;
+	return 0;
+}
+
+/* returns a bitmap of the days in the payload */
+static int fht_program_parse(const char *pos, unsigned char *program)
+{
+	unsigned int day, days = 0;
+	int err;
+
+	pos = json_skip(pos);
+	if (*pos++ != '{')
+		return -EINVAL;
+
+	pos = json_skip(pos);
+	while (*pos != '}') {
+		if (*pos++ != '"')
+			return -EINVAL;
+		for (day = 0; day < FHT_PROGRAM_DAYS; day++)
+			if (!strncmp(pos, fht_program_days[day], 3) &&
+			    pos[3] == '"')
+				break;
+		if (day == FHT_PROGRAM_DAYS)
+			return -EINVAL;
+
+		pos = json_skip(pos + 4);
+		if (*pos++ != ':')
+			return -EINVAL;
+
+		err = fht_program_parse_day(&pos, program + day * 4);
+		if (err)
+			return err;
+		days |= 1 << day;
+
+		pos = json_skip(pos);
+		if (*pos == ',')
+			pos = json_skip(pos + 1);
+		else if (*pos != '}')
+			return -EINVAL;
+	}
+
+	return *json_skip(pos + 1) ? -EINVAL : days;
+}
+
+int fht_program(const struct hauscode *hauscode, const char *payload,
+		const char *id, int priority)
+{
+	unsigned char program[FHT_PROGRAM_REGS], function_id;
+	const struct fht_device *device;
+	unsigned int i, n = 0, upload;
+	bool write[FHT_PROGRAM_REGS];
+	struct fhz *fhz;
+	int days, err;
+
+	days = fht_program_parse(payload, program);
+	if (days < 0)
+		return days;
+
+	fhz = fhz_route(hauscode);
+	if (!fhz || !fhz->txq)
+		return -ENODEV;
+
+	/* only send what the FHT doesn't already have */
+	device = fht_device_find(hauscode);
+	for (i = 0; i < FHT_PROGRAM_REGS; i++) {
+		function_id = FHT_PROGRAM + i;
+		write[i] = days & (1 << (i / 4)) &&
+			   (!device || !fht_device_valid(device, function_id) ||
+			    device->reg[function_id] != program[i]);
+		n += write[i];
+	}
+
+	/* all or nothing, a half written program is worse than none */
+	if (n > txq_space(fhz->txq))
+		return -ENOBUFS;
+
+	/*
+	 * Like the clock, the program is background work. The queue holds low
+	 * priority writes back for a moment and sends those to the same FHT
+	 * together, so the registers end up in as few frames as possible.
+	 */
+	upload = txq_program_begin(fhz->txq);
+	for (i = 0; i < FHT_PROGRAM_REGS; i++) {
+		if (!write[i])
+			continue;
+		err = txq_push_program(fhz->txq, hauscode, FHT_PROGRAM + i,
+				       program[i],
+				       priority == TXQ_PRIO_DEFAULT ?
+				       TXQ_PRIO_LOW : priority, id, upload);
+		if (err)
+			return err;
+	}
+
+	return n;
+}
+
+int fht_format_program(const struct fht_device *device, char *buffer,
+		       size_t size)
+{
+	unsigned int day, period, i, len = 0;
+	const unsigned char *regs;
+	bool known;
+
+	if (size < FHT_PROGRAM_JSON_LEN)
+		return -ENOSPC;
+
+	buffer[len++] = '{';
+	for (day = 0; day < FHT_PROGRAM_DAYS; day++) {
+		known = true;
+		for (i = 0; i < 4; i++)
+			known &= fht_device_valid(device,
+						  FHT_PROGRAM_REG(day, i));
+		if (!known)
+			continue;
+
+		if (len > 1)
+			buffer[len++] = ',';
+		buffer[len++] = '"';
+		memcpy(buffer + len, fht_program_days[day], 3);
+		len += 3;
+		memcpy(buffer + len, "\":[", 3);
+		len += 3;
+
+		regs = &device->reg[FHT_PROGRAM_REG(day, 0)];
+		for (period = 0; period < 2; period++) {
+			if (regs[period * 2] == FHT_PROGRAM_OFF)
+				continue;
+			if (buffer[len - 1] == '"')
+				buffer[len++] = ',';
+			buffer[len++] = '"';
+			fmt_fht_time(buffer + len, regs[period * 2]);
+			buffer[len + 5] = '-';
+			fmt_fht_time(buffer + len + 6, regs[period * 2 + 1]);
+			len += 11;
+			buffer[len++] = '"';
+		}
+		buffer[len++] = ']';
+	}
+	buffer[len++] = '}';
+	buffer[len] = 0;
+
+	return len;
 }
@@ -12,24 +12,169 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 
-struct payload;
+#include "metrics.h"
+
+struct fhz;
+struct fhz_frame;
+
+#define FHT_IS_VALVE 0x00
+#define FHT_VALVE_1 0x01
+#define FHT_VALVE_2 0x02
+#define FHT_VALVE_3 0x03
+#define FHT_VALVE_4 0x04
+#define FHT_VALVE_5 0x05
+#define FHT_VALVE_6 0x06
+#define FHT_VALVE_7 0x07
+#define FHT_VALVE_8 0x08
+/*
+ * The weekly program, two periods per day from monday to sunday, each a from
+ * and a to register: mon-from1, mon-to1, mon-from2, mon-to2, tue-from1, ...
+ * Times count in 10 minutes, 24:00 marks an unused period.
+ */
+#define FHT_PROGRAM 0x14
+#define FHT_PROGRAM_DAYS 7
+#define FHT_PROGRAM_REGS (FHT_PROGRAM_DAYS * 4)
+#define FHT_PROGRAM_REG(__day, __reg) (FHT_PROGRAM + 4 * (__day) + (__reg))
+#define  FHT_PROGRAM_OFF 144
+#define FHT_MODE 0x3e
+#define  FHT_MODE_AUTO 0
+#define  FHT_MODE_MANU 1
+#define  FHT_MODE_HOLI 2
+#define FHT_DESIRED_TEMP 0x41
+#define FHT_IS_TEMP_LOW 0x42
+#define FHT_IS_TEMP_HIGH 0x43
+#define FHT_STATUS 0x44
+#define FHT_MANU_TEMP 0x45
+#define FHT_ACK 0x4b
+#define FHT_YEAR 0x60
+#define FHT_MONTH 0x61
+#define FHT_DAY 0x62
+#define FHT_HOUR 0x63
+#define FHT_MINUTE 0x64
+/* the year register counts from */
+#define FHT_YEAR_BASE 2000
+/* writing 0xff makes the FHT transmit all its registers, in two parts */
+#define FHT_REPORT1 0x65
+#define FHT_REPORT2 0x66
+#define  FHT_REPORT_ALL 0xff
+#define FHT_ACK2 0x69
+#define FHT_START_XMIT 0x7d
+#define FHT_END_XMIT 0x7e
+#define FHT_DAY_TEMP 0x82
+#define FHT_NIGHT_TEMP 0x84
+#define FHT_WINDOW_OPEN_TEMP 0x8a
 
 struct hauscode {
 	unsigned char upper;
 	unsigned char lower;
 } __attribute__((packed));
 
+/* an FHT accepts up to eight register writes in one frame */
+#define FHT_MAX_COMMANDS 8
+
+struct fht_command_value {
+	unsigned char function_id;
+	unsigned char value;
+};
+
+/* fits the longest command name, "window-open-temp", and "valve/255/offset" */
+#define FHT_TOPIC_LEN 20
+
+/*
+ * A decoded frame. Reports are formatted from it only when they are
+ * published, see fht_format_report().
+ */
 struct fht_message {
 	enum {STATUS, ACK} type;
 	struct hauscode hauscode;
-	struct {
-		char topic[16];
+	unsigned char function_id;
+	unsigned char subfun;
+	unsigned char status;
+	unsigned char reports;
+	unsigned short value;
+};
+
+#define FHT_DEVICES_BITS 7
+#define FHT_DEVICES_MAX (1 << FHT_DEVICES_BITS)
+#define FHT_DEVICE_TOPICS 32
+
+/*
+ * Everything we know about a single FHT, the last value of every register it
+ * reported or acknowledged, and fields of multi-frame reports in flight.
+ */
+enum fht_latency {
+	FHT_LATENCY_QUEUE, /* command received until it was last sent */
+	FHT_LATENCY_RF, /* last sent until acknowledged */
+	FHT_LATENCY_TOTAL,
+	FHT_LATENCIES,
+};
+
+struct fht_device {
+	unsigned int key; /* see hauscode_key() */
+	bool temp_low_pending;
+	unsigned char temp_low;
+	unsigned char port; /* the FHZ the device was last heard on */
+	unsigned short paired_valves;
+	unsigned int valid[256 / 32];
+	unsigned char reg[256];
+	/* wall clock time the minute register was last reported, in s */
+	int64_t clock_reported;
+
+	/* last published status values, maintained by the MQTT side */
+	struct fht_topic_cache {
+		char topic[FHT_TOPIC_LEN];
 		char value[16];
-	} report[2];
+		uint64_t published;
+		bool dirty; /* not yet part of a published state object */
+	} topics[FHT_DEVICE_TOPICS];
+	uint64_t burst; /* start of the current transmission, 0 if none */
+
+	/* of acknowledged commands, maintained by the transmit queue */
+	struct metric_histogram_buckets latency[FHT_LATENCIES];
 };
 
+/*
+ * Keeps the device table in a file, so that restarts are warm. Must be called
+ * before any device is looked up.
+ */
+int fht_devices_open(const char *path);
+/* true if the table is kept in a file */
+bool fht_devices_persistent(void);
+void fht_devices_close(void);
+
+struct fht_device *fht_device_get(const struct hauscode *hauscode);
+struct fht_device *fht_device_find(const struct hauscode *hauscode);
+struct fht_device *fht_device_next(struct fht_device *device);
+void fht_device_update(struct fht_device *device, unsigned char function_id,
+		       unsigned char value);
+
+/* 0 marks a free slot */
+static inline unsigned int hauscode_key(const struct hauscode *hauscode)
+{
+	return ((hauscode->upper << 8) | hauscode->lower) + 1;
+}
+
+static inline struct hauscode fht_device_hauscode(struct fht_device *device)
+{
+	unsigned int key = device->key - 1;
+
+	return (struct hauscode){ .upper = key >> 8, .lower = key & 0xff };
+}
+
+#define for_each_fht_device(device) \
+	for ((device) = fht_device_next(NULL); (device); \
+	     (device) = fht_device_next((device)))
+
+static inline bool fht_device_valid(const struct fht_device *device,
+				    unsigned char function_id)
+{
+	return device->valid[function_id / 32] & (1u << (function_id % 32));
+}
+
 static inline int hauscode_from_string(const char *string,
 				       struct hauscode *hauscode)
 {
@@ -50,6 +195,36 @@ static inline int hauscode_from_string(const char *string,
 	return 0;
 }
 
-int fht_decode(const struct payload *payload, struct fht_message *message);
-int fht_set(int fd, const struct hauscode *hauscode,
-	    const char *command, const char *payload);
+/*
+ * Decodes a frame without touching the device table, so it may run in a
+ * receive thread. The main thread then applies the message to the device
+ * table with fht_update(), which returns -EAGAIN if there is nothing to
+ * report yet, e.g. for the first half of a two-frame value.
+ */
+int fht_decode(const struct fhz_frame *frame, struct fht_message *message);
+int fht_update(struct fht_message *message, unsigned char port);
+int fht_format_report(const struct fht_message *message, unsigned int n,
+		      char *topic, size_t topic_size,
+		      char *value, size_t value_size);
+/* returns the function_id of a named command, -EINVAL if there is none */
+int fht_command_id(const char *name);
+/*
+ * id is an optional correlation id, echoed when the FHT acknowledges.
+ * priority is an enum txq_priority, TXQ_PRIO_DEFAULT picks the class of the
+ * command.
+ */
+int fht_set(const struct hauscode *hauscode, unsigned char function_id,
+	    const char *payload, const char *id, int priority);
+/*
+ * Queues writes of the weekly program registers given as JSON, see README.md,
+ * that differ from what the FHT last reported. Returns their number.
+ */
+int fht_program(const struct hauscode *hauscode, const char *payload,
+		const char *id, int priority);
+/* {"mon":["HH:MM-HH:MM","HH:MM-HH:MM"],...}, including the zero */
+#define FHT_PROGRAM_JSON_LEN (FHT_PROGRAM_DAYS * 36 + 3)
+/* formats the known weekly program of a device like fht_program() takes it */
+int fht_format_program(const struct fht_device *device, char *buffer,
+		       size_t size);
+int fht_send(struct fhz *fhz, const struct hauscode *hauscode,
+	     const struct fht_command_value *commands, unsigned int n);
@@ -0,0 +1,225 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fhz.h"
+#include "loop.h"
+
+/*
+ * Open addressing with linear probing. Devices are never removed, so a
+ * lookup stops at the first free slot. The table belongs to the main thread:
+ * receive threads only decode frames, the devices are updated once the main
+ * thread handles the messages, see fhz_update().
+ *
+ * The table either lives in memory, or in a file that is mapped before any
+ * device is looked up, see fht_devices_open().
+ */
+static struct fht_device fht_devices_memory[FHT_DEVICES_MAX];
+static struct fht_device *fht_devices = fht_devices_memory;
+
+/*
+ * The file is the header, followed by the table as it is laid out in
+ * memory. The table is updated in place, and written back in batches by
+ * msync().
+ */
+#define FHT_DEVICES_MAGIC "FHTDEV1\n"
+#define FHT_DEVICES_SYNC_INTERVAL (10 * 1000)
+
+struct fht_devices_header {
+	char magic[8];
+	uint32_t device_size;
+	uint32_t devices;
+	unsigned char reserved[48];
+};
+
+struct fht_devices_file {
+	struct fht_devices_header header;
+	struct fht_device devices[FHT_DEVICES_MAX];
+};
+
+static struct fht_devices_file *fht_devices_file;
+static struct loop_timer fht_devices_timer;
+
+static inline unsigned int key_hash(unsigned int key)
+{
+	return (key * 0x9e3779b1u) >> (32 - FHT_DEVICES_BITS);
+}
+
+static struct fht_device *fht_device_slot(const struct hauscode *hauscode,
+					  bool create)
+{
+	const unsigned int key = hauscode_key(hauscode);
+	unsigned int i, slot;
+
+	slot = key_hash(key);
+	for (i = 0; i < FHT_DEVICES_MAX; i++) {
+		struct fht_device *device = &fht_devices[slot];
+
+		if (device->key == key)
+			return device;
+
+		if (!device->key) {
+			if (!create)
+				return NULL;
+			device->key = key;
+			return device;
+		}
+
+		slot = (slot + 1) & (FHT_DEVICES_MAX - 1);
+	}
+
+	return NULL;
+}
+
+struct fht_device *fht_device_get(const struct hauscode *hauscode)
+{
+	return fht_device_slot(hauscode, true);
+}
+
+struct fht_device *fht_device_find(const struct hauscode *hauscode)
+{
+	return fht_device_slot(hauscode, false);
+}
+
+/* returns the next used slot after device, or the first one for NULL */
+struct fht_device *fht_device_next(struct fht_device *device)
+{
+	device = device ? device + 1 : fht_devices;
+
+	for (; device < fht_devices + FHT_DEVICES_MAX; device++)
+		if (device->key)
+			return device;
+
+	return NULL;
+}
+
+void fht_device_update(struct fht_device *device, unsigned char function_id,
+		       unsigned char value)
+{
+	device->reg[function_id] = value;
+	device->valid[function_id / 32] |= 1u << (function_id % 32);
+}
+
+static bool fht_devices_compatible(const struct fht_devices_header *header)
+{
+	return !memcmp(header->magic, FHT_DEVICES_MAGIC,
+		       sizeof(header->magic)) &&
+	       header->device_size == sizeof(struct fht_device) &&
+	       header->devices == FHT_DEVICES_MAX;
+}
+
+/* state that only makes sense within the process that created it */
+static void fht_device_restore(struct fht_device *device)
+{
+	unsigned int i;
+
+	/* the high byte that follows may be minutes away */
+	device->temp_low_pending = false;
+	device->burst = 0;
+
+	/*
+	 * The values stay cached for -c, they are published once the broker
+	 * is connected. The clock they were published at is gone.
+	 */
+	for (i = 0; i < ARRAY_SIZE(device->topics); i++) {
+		if (device->topics[i].published)
+			device->topics[i].published = loop_now();
+		device->topics[i].dirty = false;
+	}
+}
+
+static void fht_devices_sync(struct loop_timer *timer)
+{
+	if (msync(fht_devices_file, sizeof(*fht_devices_file), MS_ASYNC))
+		warning("device state: %s\n", strerror(errno));
+	loop_timer_add(timer, FHT_DEVICES_SYNC_INTERVAL);
+}
+
+int fht_devices_open(const char *path)
+{
+	struct fht_devices_file *file;
+	struct fht_device *device;
+	unsigned int devices = 0;
+	struct stat st;
+	int fd, err = 0;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return -errno;
+
+	if (fstat(fd, &st)) {
+		err = -errno;
+		goto close_out;
+	}
+
+	if (st.st_size != sizeof(*file) &&
+	    (ftruncate(fd, 0) || ftruncate(fd, sizeof(*file)))) {
+		err = -errno;
+		goto close_out;
+	}
+
+	file = mmap(NULL, sizeof(*file), PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, 0);
+	if (file == MAP_FAILED) {
+		err = -errno;
+		goto close_out;
+	}
+
+	/* a table of another layout, or none at all, starts over */
+	if (!fht_devices_compatible(&file->header)) {
+		memset(file, 0, sizeof(*file));
+		memcpy(file->header.magic, FHT_DEVICES_MAGIC,
+		       sizeof(file->header.magic));
+		file->header.device_size = sizeof(struct fht_device);
+		file->header.devices = FHT_DEVICES_MAX;
+	}
+
+	fht_devices_file = file;
+	fht_devices = file->devices;
+	for_each_fht_device(device) {
+		fht_device_restore(device);
+		devices++;
+	}
+	info("device state %s: %u devices\n", path, devices);
+
+	fht_devices_timer.handler = fht_devices_sync;
+	loop_timer_add(&fht_devices_timer, FHT_DEVICES_SYNC_INTERVAL);
+
+close_out:
+	close(fd);
+	return err;
+}
+
+bool fht_devices_persistent(void)
+{
+	return fht_devices_file;
+}
+
+void fht_devices_close(void)
+{
+	if (!fht_devices_file)
+		return;
+
+	loop_timer_del(&fht_devices_timer);
+	if (msync(fht_devices_file, sizeof(*fht_devices_file), MS_SYNC))
+		error("device state: %s\n", strerror(errno));
+
+	fht_devices = fht_devices_memory;
+	munmap(fht_devices_file, sizeof(*fht_devices_file));
+	fht_devices_file = NULL;
+}
@@ -13,139 +13,387 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <netdb.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <unistd.h>
+#include <linux/serial.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "fhz.h"
+#include "record.h"
 
 #define FHZ_MAGIC 0x81
 
 #define BAUDRATE B9600
 
-#ifdef DEBUG
-static inline void hexdump(const unsigned char *data, size_t length)
+/*
+ * The FHZ is a byte stream. Bytes are collected in a ring and cut into frames
+ * of the form
+ *   FHZ_MAGIC | len | tt | checksum | data[len - 2]
+ * without waiting for a frame to arrive in one piece. Frames are handed to
+ * the decoder in place, without copying them out of the ring. Every port
+ * has a ring of its own.
+ */
+static struct fhz fhz_ports_table[FHZ_PORTS_MAX];
+static unsigned int fhz_ports_used;
+
+static inline unsigned char rx_peek(const struct fhz_rx *rx, unsigned int off)
 {
-	int __i;
-	for (__i = 0; __i < length; __i++)
-		printf("%02X ", data[__i]);
-	printf("\n");
+	return rx->ring[(rx->tail + off) & (FHZ_RX_SIZE - 1)];
+}
+
+static inline unsigned int rx_used(const struct fhz_rx *rx)
+{
+	return rx->head - rx->tail;
+}
+
+/* remembers when the bytes from head on arrived */
+static void fhz_rx_stamp(struct fhz_rx *rx, uint64_t now)
+{
+	/* nothing before head is of interest anymore */
+	if (!rx_used(rx))
+		rx->stamps = 0;
+
+	if (rx->stamps == FHZ_RX_STAMPS) {
+		memmove(rx->stamp, rx->stamp + 1,
+			sizeof(rx->stamp[0]) * (FHZ_RX_STAMPS - 1));
+		rx->stamps--;
+	}
+	rx->stamp[rx->stamps].pos = rx->head;
+	rx->stamp[rx->stamps].time = now;
+	rx->stamps++;
 }
-#else
-#define hexdump(...)
-#endif
 
-static int fhz_receive(int fd, struct payload *payload)
+/* arrival of the byte at tail, the first one of the next frame */
+static uint64_t fhz_rx_received(const struct fhz_rx *rx)
 {
-	unsigned char buffer[256 + 2];
-	unsigned char *payload_data;
-	struct timeval tv = {0, 0};
-	unsigned char payload_len;
-	const int maxfd = fd + 1;
-	unsigned char bc; /* the dump checksum */
-	fd_set readset;
+	unsigned int i;
+
+	for (i = rx->stamps; i > 1; i--)
+		if ((int)(rx->tail - rx->stamp[i - 1].pos) >= 0)
+			break;
+
+	/* older than all stamps, the oldest one is the closest */
+	return rx->stamps ? rx->stamp[i - 1].time : metrics_now();
+}
+
+/* the fd is non-blocking, returns -EAGAIN if nothing was pending */
+static int fhz_rx_fill(struct fhz_rx *rx, int fd)
+{
+	unsigned int pos, space;
 	ssize_t length;
-	int ret;
-	int i;
 
-	FD_ZERO(&readset);
-	FD_SET(fd, &readset);
+	pos = rx->head & (FHZ_RX_SIZE - 1);
+	space = FHZ_RX_SIZE - rx_used(rx);
+	if (space > FHZ_RX_SIZE - pos)
+		space = FHZ_RX_SIZE - pos;
 
-	errno = EAGAIN;
-	ret = select(maxfd, &readset, NULL, NULL, &tv);
-	if (ret <= 0) /* on error and timeout */
+	length = read(fd, rx->ring + pos, space);
+	if (length == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return -EAGAIN;
+		error("Read from serial fail: %s\n", strerror(errno));
 		return -errno;
+	} else if (length == 0) {
+		error("Serial port hung up\n");
+		return -EPIPE;
+	}
+	fhz_rx_stamp(rx, metrics_now());
 
-	/* on receive, just wait a bit... */
-	usleep(300000);
+	if (pos < FHZ_FRAME_MAX)
+		memcpy(rx->ring + FHZ_RX_SIZE + pos, rx->ring + pos,
+		       length < FHZ_FRAME_MAX - pos ?
+		       length : FHZ_FRAME_MAX - pos);
+	rx->head += length;
 
-	length = read(fd, buffer, 2);
-	if (length < 2) {
-		if (length == -1) {
-			error("Read from serial fail: %s\n", strerror(errno));
-			return -errno;
-		} else {
-			error("Packet shorter than four bytes: %zd\n", length);
-			return -EINVAL;
-		}
-	}
+	return 0;
+}
 
-	if (buffer[0] != FHZ_MAGIC) {
-		fprintf(stderr, "Invalid packet magic\n");
-		return -EINVAL;
-	}
+/* drop whatever is in front of the next frame magic */
+static void fhz_rx_resync(struct fhz_rx *rx)
+{
+	do
+		rx->tail++;
+	while (rx_used(rx) && rx_peek(rx, 0) != FHZ_MAGIC);
+}
 
-	length = read(fd, buffer + 2, buffer[1]);
-	if (length < buffer[1]) {
-		if (length == -1) {
-			error("Read from serial fail: %s\n", strerror(errno));
-			return -errno;
-		} else {
-			error("Packet shorter expected: got %zd, expected %u\n",
-			      length, buffer[1]);
-			return -EINVAL;
-		}
+static int fhz_rx_next(struct fhz_rx *rx, struct fhz_frame *frame)
+{
+	unsigned char length, bc; /* the dump checksum */
+	const unsigned char *data;
+	unsigned int i;
+
+	while (rx_used(rx) && rx_peek(rx, 0) != FHZ_MAGIC) {
+		warning("Invalid packet magic\n");
+		metric_inc(METRIC_RX_MAGIC_ERRORS);
+		fhz_rx_resync(rx);
 	}
 
-	length += 2;
-
-	hexdump(buffer, length);
+	if (rx_used(rx) < 2)
+		return -EAGAIN;
 
-	if (length < 4) {
-		fprintf(stderr, "Packet misses type or crc\n");
+	length = rx_peek(rx, 1);
+	if (length < 2) {
+		warning("Packet misses type or crc\n");
+		metric_inc(METRIC_RX_LENGTH_ERRORS);
+		fhz_rx_resync(rx);
 		return -EINVAL;
 	}
 
-	payload_data = buffer + 4;
-	payload_len = length - 4;
+	if (rx_used(rx) < length + 2)
+		return -EAGAIN;
+
+	/* printed like the frames of a capture for fhz_replay */
+	log_hexdump(LOG_DEBUG, "", rx->ring + (rx->tail & (FHZ_RX_SIZE - 1)),
+		    length + 2);
 
+	data = rx->ring + ((rx->tail + 4) & (FHZ_RX_SIZE - 1));
 	bc = 0;
-	for (i = 0; i < payload_len; i++)
-		bc += payload_data[i];
+	for (i = 0; i < length - 2; i++)
+		bc += data[i];
 
-	if (bc != buffer[3]) {
-		fprintf(stderr, "Packet checksum mismatch\n");
+	if (bc != rx_peek(rx, 3)) {
+		warning("Packet checksum mismatch\n");
+		metric_inc(METRIC_RX_CHECKSUM_ERRORS);
+		fhz_rx_resync(rx);
 		return -EINVAL;
 	}
 
-	payload->tt = buffer[2];
-	memcpy(payload->data, payload_data, payload_len);
-	payload->len = payload_len;
+	frame->tt = rx_peek(rx, 2);
+	frame->len = length - 2;
+	frame->data = data;
+	frame->received = fhz_rx_received(rx);
+	rx->tail += length + 2;
+
+	metric_inc(METRIC_RX_FRAMES);
 
 	return 0;
 }
 
-int fhz_handle(int fd, struct fhz_message *message)
+/*
+ * Returns the next complete frame. Reads from the serial port only if the
+ * ring doesn't contain a frame yet, and never blocks.
+ */
+static int fhz_receive(struct fhz *fhz, struct fhz_frame *frame)
 {
-	struct payload payload;
 	int err;
 
-	err = fhz_receive(fd, &payload);
-	if (err)
-		return err;
+	while ((err = fhz_rx_next(&fhz->rx, frame)) == -EAGAIN) {
+		err = fhz_rx_fill(&fhz->rx, fhz->fd);
+		if (err)
+			return err;
+	}
 
-	err = fht_decode(&payload, &message->fht);
 	if (!err) {
-		message->machine = FHT;
-		return 0;
-	} else if (!(err == -EINVAL || err == -EAGAIN)) {
+		frame->port = fhz->index;
+		record_frame(RECORD_RX, fhz->index, frame->tt, frame->data,
+			     frame->len);
+	}
+
+	return err;
+}
+
+static int fhz_decode_fht(const struct fhz_frame *frame,
+			  struct fhz_message *message)
+{
+	return fht_decode(frame, &message->fht);
+}
+
+static int fhz_decode_fs20(const struct fhz_frame *frame,
+			   struct fhz_message *message)
+{
+	return fs20_decode(frame, &message->fs20);
+}
+
+/*
+ * Frames are dispatched to the decoder of a device family by their tt and
+ * the magic their data starts with. Bits of the magic that are masked out
+ * may have any value. A new family is added with an entry here, and a case
+ * in mqtt_publish().
+ */
+#define FHZ_DECODER_MAGIC 4
+
+struct fhz_decoder {
+	enum fhz_machine machine;
+	/* bitmap of accepted tt values, 0 accepts all */
+	unsigned short tts;
+	unsigned char magic[FHZ_DECODER_MAGIC];
+	unsigned char mask[FHZ_DECODER_MAGIC];
+	int (*decode)(const struct fhz_frame *frame,
+		      struct fhz_message *message);
+};
+
+#define FHZ_DECODER_EXACT {0xff, 0xff, 0xff, 0xff}
+
+/* at most 32, see fhz_dispatch */
+static const struct fhz_decoder fhz_decoders[] = {
+	/* fht status */ {
+		.machine = FHT,
+		.magic = {0x09, 0x09, 0xa0, 0x01},
+		.mask = FHZ_DECODER_EXACT,
+		.decode = fhz_decode_fht,
+	},
+	/* fht ack */ {
+		.machine = FHT,
+		.magic = {0x83, 0x09, 0x83, 0x01},
+		.mask = FHZ_DECODER_EXACT,
+		.decode = fhz_decode_fht,
+	},
+	/* fs20 */ {
+		.machine = FS20,
+		.tts = 1 << 0x04 | 1 << 0x0c,
+		.magic = {0x01, 0x01, 0xa0, 0x01},
+		.mask = FHZ_DECODER_EXACT,
+		.decode = fhz_decode_fs20,
+	},
+};
+
+/*
+ * Decoders that accept a frame starting with the index, as a bitmap of
+ * fhz_decoders. Usually, a frame is dispatched with a single compare of the
+ * rest of its magic.
+ */
+static unsigned int fhz_dispatch[256];
+
+static void fhz_decoders_init(void)
+{
+	const struct fhz_decoder *decoder;
+	unsigned int i, byte;
+
+	for (i = 0; i < ARRAY_SIZE(fhz_decoders); i++) {
+		decoder = &fhz_decoders[i];
+		for (byte = 0; byte < 256; byte++)
+			if (!((byte ^ decoder->magic[0]) & decoder->mask[0]))
+				fhz_dispatch[byte] |= 1u << i;
+	}
+}
+
+static const struct fhz_decoder *fhz_decoder(const struct fhz_frame *frame)
+{
+	const struct fhz_decoder *decoder;
+	unsigned int candidates, i;
+
+	if (frame->len < FHZ_DECODER_MAGIC)
+		return NULL;
+
+	for (candidates = fhz_dispatch[frame->data[0]]; candidates;
+	     candidates &= candidates - 1) {
+		decoder = &fhz_decoders[__builtin_ctz(candidates)];
+		if (decoder->tts &&
+		    (frame->tt >= 16 || !(decoder->tts & 1 << frame->tt)))
+			continue;
+
+		for (i = 1; i < FHZ_DECODER_MAGIC; i++)
+			if ((frame->data[i] ^ decoder->magic[i]) &
+			    decoder->mask[i])
+				break;
+		if (i == FHZ_DECODER_MAGIC)
+			return decoder;
+	}
+
+	return NULL;
+}
+
+int fhz_handle(struct fhz *fhz, struct fhz_message *message)
+{
+	const struct fhz_decoder *decoder;
+	struct fhz_frame frame;
+	int err;
+
+	err = fhz_receive(fhz, &frame);
+	if (err)
 		return err;
+	message->port = fhz->index;
+	message->received = frame.received;
+
+	decoder = fhz_decoder(&frame);
+	if (!decoder) {
+		metric_inc(METRIC_DECODE_UNKNOWN);
+		return -EINVAL;
 	}
 
-	/* handle payloads other than FHT */
+	err = decoder->decode(&frame, message);
+	if (err)
+		return err;
+	message->machine = decoder->machine;
+
+	return 0;
+}
+
+int fhz_update(struct fhz_message *message)
+{
+	int err;
+
+	/* FS20 devices have no state */
+	if (message->machine != FHT)
+		return 0;
+
+	err = fht_update(&message->fht, message->port);
+	/* valid frame, but nothing to report (yet) */
+	if (err == -EAGAIN)
+		return -ENODATA;
 
 	return err;
 }
 
-int fhz_send(int fd, const struct payload *payload)
+struct fhz *fhz_add(int fd)
+{
+	struct fhz *fhz;
+
+	if (fhz_ports_used == FHZ_PORTS_MAX)
+		return NULL;
+	if (!fhz_ports_used)
+		fhz_decoders_init();
+
+	fhz = &fhz_ports_table[fhz_ports_used];
+	fhz->index = fhz_ports_used++;
+	fhz->fd = fd;
+
+	return fhz;
+}
+
+struct fhz *fhz_port(unsigned int index)
+{
+	return index < fhz_ports_used ? &fhz_ports_table[index] : NULL;
+}
+
+unsigned int fhz_ports(void)
+{
+	return fhz_ports_used;
+}
+
+/* FHTs that were never heard of are reached through the first port */
+struct fhz *fhz_route(const struct hauscode *hauscode)
+{
+	struct fht_device *device;
+
+	device = fht_device_find(hauscode);
+	if (device && device->port < fhz_ports_used)
+		return &fhz_ports_table[device->port];
+
+	return fhz_port(0);
+}
+
+int fhz_send(struct fhz *fhz, const struct payload *payload)
 {
-	unsigned char buffer[256-2];
+	unsigned char buffer[FHZ_FRAME_MAX];
 	unsigned char bc;
 	int i, ret;
 
+	/* the length byte covers tt, checksum and data */
+	if (payload->len > sizeof(buffer) - 4)
+		return -EINVAL;
+
+	/* lost, and not yet reopened */
+	if (fhz->fd < 0)
+		return -ENOTCONN;
+
 	bc = 0;
 	for (i = 0; i < payload->len; i++)
 		bc += payload->data[i];
@@ -156,14 +404,18 @@ int fhz_send(int fd, const struct payload *payload)
 	buffer[3] = bc;
 	memcpy(buffer + 4, payload->data, payload->len);
 
-	hexdump(buffer, payload->len + 4);
+	log_hexdump(LOG_DEBUG, "tx: ", buffer, payload->len + 4);
 
 #ifndef NO_SEND
-	ret = write(fd, buffer, payload->len + 4);
+	ret = write(fhz->fd, buffer, payload->len + 4);
 	if (ret != payload->len + 4) {
-		fprintf(stderr, "Error sending FHZ sequence\n");
+		error("Error sending FHZ sequence\n");
+		metric_inc(METRIC_TX_ERRORS);
 		return -EINVAL;
 	}
+	metric_inc(METRIC_TX_FRAMES);
+	record_frame(RECORD_TX, fhz->index, payload->tt, payload->data,
+		     payload->len);
 #else
 	(void)ret; /* surpress compiler warning */
 #endif
@@ -171,60 +423,158 @@ int fhz_send(int fd, const struct payload *payload)
 	return 0;
 }
 
-int fhz_open_serial(const char *device)
+/* FTDI adapters otherwise hold back received bytes for up to 16ms */
+static void fhz_low_latency(int fd, const char *device)
+{
+	struct serial_struct serial;
+
+	if (ioctl(fd, TIOCGSERIAL, &serial) == -1)
+		goto out;
+
+	serial.flags |= ASYNC_LOW_LATENCY;
+	if (ioctl(fd, TIOCSSERIAL, &serial) == -1)
+		goto out;
+	return;
+
+out:
+	debug("%s: no low latency mode: %s\n", device, strerror(errno));
+}
+
+static int fhz_open_serial(const char *device)
 {
 	struct termios tty;
 	int err, fd;
 
-        fd = open(device, O_RDWR | O_NOCTTY);
-        if (fd == -1) {
-		error("opening %s: %s\n", device, strerror(errno));
-		return -errno;
+	/* reads never block, the main loop or receive thread polls */
+	fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1) {
+		err = -errno;
+		error("opening %s: %s\n", device, strerror(-err));
+		return err;
 	}
 
-        memset(&tty, 0, sizeof tty);
-        err = tcgetattr (fd, &tty);
-	if (err) {
-		error("tcgetattr: %s\n", strerror(errno));
+	/* a second bridge, or a terminal, would steal our frames */
+	if (ioctl(fd, TIOCEXCL) == -1) {
+		err = -errno;
+		error("%s: exclusive access: %s\n", device, strerror(-err));
 		goto close_out;
 	}
 
-        err = cfsetospeed (&tty, BAUDRATE);
-	if (err) {
-		error("cfsetospeed: %s\n", strerror(errno));
+	if (tcgetattr(fd, &tty)) {
+		err = -errno;
+		error("tcgetattr: %s\n", strerror(-err));
 		goto close_out;
 	}
 
-        err = cfsetispeed(&tty, BAUDRATE);
-	if (err) {
-		error("cfsetispeed: %s\n", strerror(errno));
+	cfmakeraw(&tty);
+	tty.c_cflag |= CLOCAL | CREAD;
+	tty.c_cflag &= ~(CSTOPB | CRTSCTS);
+	tty.c_cc[VMIN] = 1;
+	tty.c_cc[VTIME] = 0;
+
+	if (cfsetospeed(&tty, BAUDRATE) || cfsetispeed(&tty, BAUDRATE) ||
+	    tcsetattr(fd, TCSANOW, &tty)) {
+		err = -errno;
+		error("tcsetattr: %s\n", strerror(-err));
+		goto close_out;
+	}
+
+	/* tcsetattr() succeeds if any of the changes could be applied */
+	if (tcgetattr(fd, &tty)) {
+		err = -errno;
+		error("tcgetattr: %s\n", strerror(-err));
+		goto close_out;
+	}
+	if (cfgetispeed(&tty) != BAUDRATE || cfgetospeed(&tty) != BAUDRATE) {
+		err = -EINVAL;
+		error("%s: unable to set 9600 baud\n", device);
 		goto close_out;
 	}
 
-        tty.c_cflag = (tty.c_cflag & ~CSIZE) | CS8;
-        tty.c_iflag &= ~IGNBRK;
-        tty.c_lflag = 0;
-        tty.c_oflag = 0;
-        tty.c_cc[VMIN]  = 0;
-        tty.c_cc[VTIME] = 10;
+	fhz_low_latency(fd, device);
 
-        tty.c_iflag &= ~(IXON | IXOFF | IXANY);
+	/* whatever arrived before is of another life */
+	tcflush(fd, TCIOFLUSH);
+
+	return fd;
 
-        tty.c_cflag |= (CLOCAL | CREAD);
-        tty.c_cflag &= ~(PARENB | PARODD);
-        tty.c_cflag &= ~CSTOPB;
-        tty.c_cflag &= ~CRTSCTS;
+close_out:
+	close(fd);
+	return err;
+}
 
-        err = tcsetattr (fd, TCSANOW, &tty);
+/* a raw TCP port, e.g. ser2net, that forwards the serial line of an FHZ */
+static int fhz_open_tcp(const char *device)
+{
+	const struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	char host[256], *port;
+	struct addrinfo *res, *ai;
+	int err, fd = -1, on = 1;
+
+	if (snprintf(host, sizeof(host), "%s", device) >= sizeof(host))
+		return -ENAMETOOLONG;
+
+	/* the last colon separates the port, IPv6 hosts are in brackets */
+	port = strrchr(host, ':');
+	if (!port || port == host) {
+		error("%s: expected tcp:host:port\n", device);
+		return -EINVAL;
+	}
+	*port++ = 0;
+	if (host[0] == '[' && port[-2] == ']') {
+		port[-2] = 0;
+		memmove(host, host + 1, strlen(host));
+	}
+
+	err = getaddrinfo(host, port, &hints, &res);
 	if (err) {
-		error("tcsetattr: %s", strerror(errno));
-		goto close_out;
+		error("%s: %s\n", device, gai_strerror(err));
+		return -EHOSTUNREACH;
+	}
 
+	/*
+	 * The connection is established in the background, so that reopening
+	 * a lost FHZ never blocks the main loop. If it fails, the first read
+	 * does, like on a connection that was lost.
+	 */
+	err = -ECONNREFUSED;
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family,
+			    ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			    ai->ai_protocol);
+		if (fd == -1) {
+			err = -errno;
+			continue;
+		}
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen) ||
+		    errno == EINPROGRESS)
+			break;
+		err = -errno;
+		close(fd);
+		fd = -1;
 	}
+	freeaddrinfo(res);
+
+	if (fd == -1) {
+		error("connecting to %s: %s\n", device, strerror(-err));
+		return err;
+	}
+
+	/* frames are small and a command should leave at once */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	/* notices a remote end that went away without closing */
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
 
 	return fd;
+}
 
-close_out:
-	close(fd);
-	return -errno;
+int fhz_open(const char *device)
+{
+	if (!strncmp(device, FHZ_TCP_PREFIX, sizeof(FHZ_TCP_PREFIX) - 1))
+		return fhz_open_tcp(device + sizeof(FHZ_TCP_PREFIX) - 1);
+
+	return fhz_open_serial(device);
 }
@@ -11,6 +11,8 @@
  */
 
 #include "fht.h"
+#include "fs20.h"
+#include "log.h"
 
 #define ARRAY_SIZE(a) sizeof(a) / sizeof(a[0])
 #define __stringify(a) __str(a)
@@ -19,28 +21,94 @@
 #define FHZ_MAGIC 0x81
 #define BAUDRATE B9600
 
-#define error(...) \
-	do { \
-		char error_buffer[128]; \
-		snprintf(error_buffer, sizeof(error_buffer), __VA_ARGS__);  \
-		fprintf(stderr, error_buffer); \
-	} while(0)
-
 struct payload {
 	unsigned char tt;
 	unsigned char len;
 	unsigned char data[256];
 };
 
+/* must be a power of two and hold at least one frame of 2 + 255 bytes */
+#define FHZ_RX_SIZE 1024
+#define FHZ_FRAME_MAX (2 + 255)
+/* reads a frame may be spread over and still be timed exactly */
+#define FHZ_RX_STAMPS 4
+
+/*
+ * The first FHZ_FRAME_MAX bytes of the ring are mirrored behind its end, so
+ * every frame can be viewed in one piece, no matter where it starts.
+ */
+struct fhz_rx {
+	unsigned char ring[FHZ_RX_SIZE + FHZ_FRAME_MAX];
+	unsigned int head; /* free running write position */
+	unsigned int tail; /* free running read position */
+	/* when the bytes from pos on arrived, in the order of the reads */
+	struct {
+		unsigned int pos;
+		uint64_t time;
+	} stamp[FHZ_RX_STAMPS];
+	unsigned int stamps;
+};
+
+/*
+ * A received frame, data points into the receive ring and is valid until the
+ * next read from the serial port.
+ */
+struct fhz_frame {
+	unsigned char tt;
+	unsigned char len;
+	unsigned char port; /* index of the receiving FHZ */
+	/* arrival of the first byte, CLOCK_MONOTONIC in ns */
+	uint64_t received;
+	const unsigned char *data;
+};
+
+#define FHZ_PORTS_MAX 8
+
+struct txq;
+
+/* an FHZ stick, FHTs are reached through the one they were last heard on */
+struct fhz {
+	unsigned int index;
+	int fd;
+	struct fhz_rx rx;
+	struct txq *txq;
+};
+
+/* the device families behind an FHZ, see fhz_decoders in fhz.c */
+enum fhz_machine {
+	FHZ_NONE,
+	FHT,
+	FS20,
+	FHZ_MACHINES,
+};
+
 struct fhz_message {
-	enum {
-		FHT,
-	} machine;
+	enum fhz_machine machine;
+	unsigned char port;
+	uint64_t received; /* CLOCK_MONOTONIC in ns */
 	union {
 		struct fht_message fht;
+		struct fs20_message fs20;
 	};
 };
 
-int fhz_open_serial(const char *device);
-int fhz_send(int fd, const struct payload *payload);
-int fhz_handle(int fd, struct fhz_message *message);
+/* devices of this form are FHZ behind a raw TCP port, e.g. ser2net */
+#define FHZ_TCP_PREFIX "tcp:"
+
+/* a serial port or FHZ_TCP_PREFIX "host:port", the fd is non-blocking */
+int fhz_open(const char *device);
+
+/* registers a port for an open fd, NULL if FHZ_PORTS_MAX are in use */
+struct fhz *fhz_add(int fd);
+struct fhz *fhz_port(unsigned int index);
+unsigned int fhz_ports(void);
+struct fhz *fhz_route(const struct hauscode *hauscode);
+
+int fhz_send(struct fhz *fhz, const struct payload *payload);
+/* reassembles and decodes the next frame, safe in a receive thread */
+int fhz_handle(struct fhz *fhz, struct fhz_message *message);
+/*
+ * Applies a message of fhz_handle() to the device state, from the main
+ * thread only. Returns -ENODATA if there is nothing to publish (yet).
+ */
+int fhz_update(struct fhz_message *message);
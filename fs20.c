@@ -0,0 +1,75 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+
+#include "fhz.h"
+
+/*
+ * FS20 frames received by the FHZ are of the form
+ *   01 01 a0 01 | hauscode[2] | button | command [| timer]
+ */
+#define FS20_LEN 8
+
+static const char *const fs20_commands[32] = {
+	"off", "dim06%", "dim12%", "dim18%", "dim25%", "dim31%", "dim37%",
+	"dim43%", "dim50%", "dim56%", "dim62%", "dim68%", "dim75%", "dim81%",
+	"dim87%", "dim93%", "dim100%", "on", "toggle", "dimup", "dimdown",
+	"dimupdown", "timer", "sendstate", "off-for-timer", "on-for-timer",
+	"on-old-for-timer", "reset", "ramp-on-time", "ramp-off-time",
+	"on-old-for-timer-prev", "on-100-for-timer-prev",
+};
+
+int fs20_decode(const struct fhz_frame *frame, struct fs20_message *message)
+{
+	if (frame->len < FS20_LEN)
+		return -EINVAL;
+
+	message->hauscode[0] = frame->data[4];
+	message->hauscode[1] = frame->data[5];
+	message->button = frame->data[6];
+	message->command = frame->data[7];
+	message->timer = 0;
+	message->reports = 1;
+
+	if (message->command & FS20_EXTENDED) {
+		if (frame->len < FS20_LEN + 1)
+			return -EINVAL;
+		message->timer = frame->data[FS20_LEN];
+		message->reports = 2;
+	}
+
+	return 0;
+}
+
+int fs20_format_report(const struct fs20_message *message, unsigned int n,
+		       char *topic, size_t topic_size,
+		       char *value, size_t value_size)
+{
+	unsigned int quarters;
+
+	if (n >= message->reports)
+		return -ENOENT;
+
+	if (n == 0) {
+		snprintf(topic, topic_size, "%02x", message->button);
+		return snprintf(value, value_size, "%s",
+				fs20_commands[message->command & 0x1f]);
+	}
+
+	/* 2^high nibble * low nibble quarter seconds */
+	quarters = (message->timer & 0x0f) << (message->timer >> 4);
+	snprintf(topic, topic_size, "%02x/timer", message->button);
+	return snprintf(value, value_size, "%u.%02u", quarters / 4,
+			quarters % 4 * 25);
+}
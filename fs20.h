@@ -0,0 +1,33 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <stddef.h>
+
+struct fhz_frame;
+
+/* the command is followed by a timer byte */
+#define FS20_EXTENDED 0x20
+
+/* a command sent by an FS20 remote or sensor, as received by the FHZ */
+struct fs20_message {
+	unsigned char hauscode[2];
+	unsigned char button;
+	unsigned char command;
+	unsigned char timer;
+	unsigned char reports;
+};
+
+int fs20_decode(const struct fhz_frame *frame, struct fs20_message *message);
+/* like fht_format_report(), topics are below the device */
+int fs20_format_report(const struct fs20_message *message, unsigned int n,
+		       char *topic, size_t topic_size,
+		       char *value, size_t value_size);
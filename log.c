@@ -0,0 +1,211 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "log.h"
+
+#define LOG_LINE_MAX 256
+/* must be a power of two */
+#define LOG_RING_SIZE 128
+
+#ifdef DEBUG
+int log_level = LOG_DEBUG;
+#else
+int log_level = LOG_WARNING;
+#endif
+
+static enum log_sink log_sink = LOG_SINK_STDERR;
+
+/*
+ * The asynchronous sink. Lines are dropped rather than blocking the caller
+ * if the writer falls behind.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool running;
+	bool stop;
+	unsigned int head, tail; /* free running */
+	unsigned int dropped;
+	struct {
+		int level;
+		char line[LOG_LINE_MAX];
+	} ring[LOG_RING_SIZE];
+} log_ring = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static const char *const log_level_names[] = {
+	[LOG_ERR] = "error",
+	[LOG_WARNING] = "warning",
+	[LOG_NOTICE] = "notice",
+	[LOG_INFO] = "info",
+	[LOG_DEBUG] = "debug",
+};
+
+int log_parse_level(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(log_level_names) / sizeof(log_level_names[0]);
+	     i++)
+		if (log_level_names[i] && !strcasecmp(name, log_level_names[i]))
+			return i;
+
+	return -EINVAL;
+}
+
+static void log_emit(int level, const char *line)
+{
+	if (log_sink == LOG_SINK_SYSLOG)
+		syslog(level, "%.*s", (int)strcspn(line, "\n"), line);
+	else
+		fputs(line, stderr);
+}
+
+static void *log_thread(void *arg)
+{
+	char line[LOG_LINE_MAX];
+	unsigned int dropped;
+	int level = LOG_INFO;
+
+	pthread_mutex_lock(&log_ring.lock);
+	for (;;) {
+		while (log_ring.head == log_ring.tail && !log_ring.dropped &&
+		       !log_ring.stop)
+			pthread_cond_wait(&log_ring.cond, &log_ring.lock);
+
+		if (log_ring.head == log_ring.tail && !log_ring.dropped)
+			break;
+
+		dropped = log_ring.dropped;
+		log_ring.dropped = 0;
+		if (log_ring.head != log_ring.tail) {
+			level = log_ring.ring[log_ring.tail % LOG_RING_SIZE].level;
+			memcpy(line,
+			       log_ring.ring[log_ring.tail % LOG_RING_SIZE].line,
+			       sizeof(line));
+			log_ring.tail++;
+		} else
+			line[0] = 0;
+		pthread_mutex_unlock(&log_ring.lock);
+
+		if (dropped) {
+			char notice[64];
+
+			snprintf(notice, sizeof(notice),
+				 "log: %u messages dropped\n", dropped);
+			log_emit(LOG_WARNING, notice);
+		}
+		if (line[0])
+			log_emit(level, line);
+
+		pthread_mutex_lock(&log_ring.lock);
+	}
+	pthread_mutex_unlock(&log_ring.lock);
+
+	return NULL;
+}
+
+static void log_write(int level, const char *line)
+{
+	if (!log_ring.running) {
+		log_emit(level, line);
+		return;
+	}
+
+	pthread_mutex_lock(&log_ring.lock);
+	if (log_ring.head - log_ring.tail == LOG_RING_SIZE) {
+		log_ring.dropped++;
+	} else {
+		log_ring.ring[log_ring.head % LOG_RING_SIZE].level = level;
+		strcpy(log_ring.ring[log_ring.head % LOG_RING_SIZE].line, line);
+		log_ring.head++;
+	}
+	pthread_cond_signal(&log_ring.cond);
+	pthread_mutex_unlock(&log_ring.lock);
+}
+
+void __log_printf(int level, const char *format, ...)
+{
+	char line[LOG_LINE_MAX];
+	va_list ap;
+
+	va_start(ap, format);
+	vsnprintf(line, sizeof(line), format, ap);
+	va_end(ap);
+
+	log_write(level, line);
+}
+
+void __log_hexdump(int level, const char *prefix, const unsigned char *data,
+		   unsigned int len)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	char line[LOG_LINE_MAX];
+	unsigned int i, pos;
+
+	pos = snprintf(line, sizeof(line), "%s", prefix);
+	for (i = 0; i < len && pos + 4 < sizeof(line); i++) {
+		line[pos++] = hex[data[i] >> 4];
+		line[pos++] = hex[data[i] & 0xf];
+		line[pos++] = ' ';
+	}
+	line[pos++] = '\n';
+	line[pos] = 0;
+
+	log_write(level, line);
+}
+
+int log_init(enum log_sink sink, bool async)
+{
+	int err;
+
+	log_sink = sink;
+	if (sink == LOG_SINK_SYSLOG)
+		openlog("fhz2mqtt", LOG_PID, LOG_DAEMON);
+
+	if (!async)
+		return 0;
+
+	err = -pthread_create(&log_ring.thread, NULL, log_thread, NULL);
+	if (err)
+		return err;
+	log_ring.running = true;
+
+	return 0;
+}
+
+void log_close(void)
+{
+	if (log_ring.running) {
+		pthread_mutex_lock(&log_ring.lock);
+		log_ring.stop = true;
+		pthread_cond_signal(&log_ring.cond);
+		pthread_mutex_unlock(&log_ring.lock);
+
+		pthread_join(log_ring.thread, NULL);
+		log_ring.running = false;
+	}
+
+	if (log_sink == LOG_SINK_SYSLOG)
+		closelog();
+}
@@ -0,0 +1,58 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <stdbool.h>
+#include <syslog.h>
+
+/*
+ * Levels are syslog priorities. A message below log_level costs a single
+ * compare, its arguments aren't even evaluated.
+ */
+extern int log_level;
+
+#define log_enabled(level) ((level) <= log_level)
+
+#define log_printf(level, ...) \
+	do { \
+		if (log_enabled(level)) \
+			__log_printf(level, __VA_ARGS__); \
+	} while (0)
+
+#define error(...) log_printf(LOG_ERR, __VA_ARGS__)
+#define warning(...) log_printf(LOG_WARNING, __VA_ARGS__)
+#define info(...) log_printf(LOG_INFO, __VA_ARGS__)
+#define debug(...) log_printf(LOG_DEBUG, __VA_ARGS__)
+
+#define log_hexdump(level, prefix, data, len) \
+	do { \
+		if (log_enabled(level)) \
+			__log_hexdump(level, prefix, data, len); \
+	} while (0)
+
+enum log_sink {
+	LOG_SINK_STDERR,
+	LOG_SINK_SYSLOG, /* also ends up in the journal */
+};
+
+int log_parse_level(const char *name);
+
+/*
+ * Without log_init(), messages go synchronously to stderr. If async is set,
+ * messages are formatted by the caller and written by a separate thread.
+ */
+int log_init(enum log_sink sink, bool async);
+void log_close(void);
+
+void __log_printf(int level, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+void __log_hexdump(int level, const char *prefix, const unsigned char *data,
+		   unsigned int len);
@@ -0,0 +1,152 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include "loop.h"
+
+#define LOOP_MAX_FDS 16
+
+static struct loop_fd *watches;
+static struct loop_timer *timers;
+static volatile sig_atomic_t stop;
+
+uint64_t loop_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void loop_fd_add(struct loop_fd *watch)
+{
+	watch->next = watches;
+	watches = watch;
+}
+
+void loop_fd_del(struct loop_fd *watch)
+{
+	struct loop_fd **p;
+
+	for (p = &watches; *p; p = &(*p)->next)
+		if (*p == watch) {
+			*p = watch->next;
+			return;
+		}
+}
+
+void loop_timer_add(struct loop_timer *timer, unsigned int ms)
+{
+	timer->expires = loop_now() + ms;
+	if (timer->armed)
+		return;
+
+	timer->armed = 1;
+	timer->next = timers;
+	timers = timer;
+}
+
+void loop_timer_del(struct loop_timer *timer)
+{
+	struct loop_timer **p;
+
+	if (!timer->armed)
+		return;
+
+	for (p = &timers; *p; p = &(*p)->next)
+		if (*p == timer) {
+			*p = timer->next;
+			break;
+		}
+	timer->armed = 0;
+}
+
+/* returns the poll() timeout until the next timer expires */
+static int loop_timers_run(void)
+{
+	struct loop_timer *timer, **p;
+	uint64_t now, next;
+
+again:
+	now = loop_now();
+	for (p = &timers; *p; p = &(*p)->next) {
+		timer = *p;
+		if (timer->expires > now)
+			continue;
+
+		*p = timer->next;
+		timer->armed = 0;
+		timer->handler(timer);
+		/* the handler may have modified the list */
+		goto again;
+	}
+
+	next = UINT64_MAX;
+	for (timer = timers; timer; timer = timer->next)
+		if (timer->expires < next)
+			next = timer->expires;
+
+	if (next == UINT64_MAX)
+		return -1;
+
+	return next - now;
+}
+
+void loop_stop(void)
+{
+	stop = 1;
+}
+
+int loop_run(void)
+{
+	struct loop_fd *watch, *polled[LOOP_MAX_FDS];
+	struct pollfd fds[LOOP_MAX_FDS];
+	int i, nfds, timeout, ret;
+
+	while (!stop) {
+		timeout = loop_timers_run();
+		if (stop)
+			break;
+
+		nfds = 0;
+		for (watch = watches; watch; watch = watch->next) {
+			if (watch->prepare)
+				watch->prepare(watch);
+			if (watch->fd < 0 || nfds == LOOP_MAX_FDS)
+				continue;
+
+			fds[nfds].fd = watch->fd;
+			fds[nfds].events = watch->events;
+			fds[nfds].revents = 0;
+			polled[nfds++] = watch;
+		}
+
+		ret = poll(fds, nfds, timeout);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		for (i = 0; i < nfds && ret; i++) {
+			if (!fds[i].revents)
+				continue;
+			ret--;
+			polled[i]->handler(polled[i], fds[i].revents);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+/*
+ * A file descriptor watched by the main loop. The owner embeds the structure
+ * and may change fd and events at any time. If prepare is set, it is called
+ * before every poll() and may update both. A negative fd is not polled.
+ */
+struct loop_fd {
+	int fd;
+	short events;
+	void (*prepare)(struct loop_fd *watch);
+	void (*handler)(struct loop_fd *watch, short revents);
+	struct loop_fd *next;
+};
+
+/* A oneshot timer, rearm it from its handler for periodic work. */
+struct loop_timer {
+	uint64_t expires;
+	void (*handler)(struct loop_timer *timer);
+	struct loop_timer *next;
+	int armed;
+};
+
+uint64_t loop_now(void);
+
+void loop_fd_add(struct loop_fd *watch);
+void loop_fd_del(struct loop_fd *watch);
+
+void loop_timer_add(struct loop_timer *timer, unsigned int ms);
+void loop_timer_del(struct loop_timer *timer);
+
+int loop_run(void);
+void loop_stop(void);
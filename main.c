@@ -11,79 +11,854 @@
  */
 
 #include <errno.h>
-#include <stdbool.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "clocksync.h"
+#include "config.h"
 #include "fhz.h"
+#include "loop.h"
 #include "mqtt.h"
+#include "prefetch.h"
+#include "record.h"
+#include "rxq.h"
+#include "txq.h"
 
 #define MQTT_DEFAULT_PORT 1883
 #define MQTT_DEFAULT_HOSTNAME "localhost"
 
+#define RXQ_DEFAULT_SIZE 256
+#define STATS_INTERVAL (60 * 1000)
+
+/* ms between two attempts to reopen a lost FHZ, doubled after every one */
+#define PORT_BACKOFF_MIN 1000
+#define PORT_BACKOFF_MAX (60 * 1000)
+
+/* the settings of main(), from the command line or a configuration file */
+static struct {
+	char *serial;
+	const char *hostname;
+	unsigned int port;
+	const char *username, *password;
+	bool threaded;
+	unsigned int rxq_size;
+	const char *recording, *prefetch, *devices;
+	unsigned int clock_sync;
+	enum log_sink log_sink;
+	bool log_async;
+} config = {
+	.hostname = MQTT_DEFAULT_HOSTNAME,
+	.port = MQTT_DEFAULT_PORT,
+	.rxq_size = RXQ_DEFAULT_SIZE,
+	.log_sink = LOG_SINK_STDERR,
+};
+
+/* options without a short one */
+enum {
+	OPT_SERIAL = 0x100,
+	OPT_HOST,
+	OPT_PORT,
+	OPT_USERNAME,
+	OPT_PASSWORD,
+	OPT_QUEUE_SIZE,
+	OPT_TIMEOUT,
+	OPT_RETRIES,
+	OPT_HOLD,
+};
+
+#define OPTIONS "hC:T:tq:ca:rsjb:B:I:PQ:k:m:5w:i:F:R:p:K:D:l:SA"
+
+/* the long names are the keys of the configuration file */
+static const struct option options[] = {
+	{ "help", no_argument, NULL, 'h' },
+	{ "config", required_argument, NULL, 'C' },
+	{ "serial", required_argument, NULL, OPT_SERIAL },
+	{ "host", required_argument, NULL, OPT_HOST },
+	{ "port", required_argument, NULL, OPT_PORT },
+	{ "username", required_argument, NULL, OPT_USERNAME },
+	{ "password", required_argument, NULL, OPT_PASSWORD },
+	{ "prefix", required_argument, NULL, 'T' },
+	{ "threaded", no_argument, NULL, 't' },
+	{ "rxq-size", required_argument, NULL, 'q' },
+	{ "changes-only", no_argument, NULL, 'c' },
+	{ "max-age", required_argument, NULL, 'a' },
+	{ "retain", no_argument, NULL, 'r' },
+	{ "snapshot", no_argument, NULL, 's' },
+	{ "json", no_argument, NULL, 'j' },
+	{ "spool", required_argument, NULL, 'b' },
+	{ "spool-file", required_argument, NULL, 'B' },
+	{ "client-id", required_argument, NULL, 'I' },
+	{ "persistent", no_argument, NULL, 'P' },
+	{ "qos", required_argument, NULL, 'Q' },
+	{ "keepalive", required_argument, NULL, 'k' },
+	{ "max-inflight", required_argument, NULL, 'm' },
+	{ "mqtt5", no_argument, NULL, '5' },
+	{ "window", required_argument, NULL, 'w' },
+	{ "interval", required_argument, NULL, 'i' },
+	{ "fair-share", required_argument, NULL, 'F' },
+	{ "queue-size", required_argument, NULL, OPT_QUEUE_SIZE },
+	{ "timeout", required_argument, NULL, OPT_TIMEOUT },
+	{ "retries", required_argument, NULL, OPT_RETRIES },
+	{ "hold", required_argument, NULL, OPT_HOLD },
+	{ "record", required_argument, NULL, 'R' },
+	{ "prefetch", required_argument, NULL, 'p' },
+	{ "clock-sync", required_argument, NULL, 'K' },
+	{ "device-state", required_argument, NULL, 'D' },
+	{ "log-level", required_argument, NULL, 'l' },
+	{ "syslog", no_argument, NULL, 'S' },
+	{ "log-async", no_argument, NULL, 'A' },
+	{ NULL, 0, NULL, 0 },
+};
+
 static void __attribute__((noreturn)) usage(int code)
 {
-	printf("Usage: fht2mqtt usb_port"
-	       "[mqtt_server] [mqtt_port] [username] [password]\n");
+	printf("Usage: fht2mqtt [options] [usb_port[,usb_port...] "
+	       "[mqtt_server] [mqtt_port] [username] [password]]\n"
+	       "  -C, --config        read options from a file, one long "
+	       "option per line\n"
+	       "      --serial        serial ports, instead of usb_port, "
+	       "tcp:host:port for ser2net\n"
+	       "      --host, --port, --username, --password\n"
+	       "                      the MQTT broker (%s:%u)\n"
+	       "  -T, --prefix        prefix of all topics (%s)\n"
+	       "  -t, --threaded      receive from each serial port in a "
+	       "separate thread\n"
+	       "  -q, --rxq-size      size of the receive queue in threaded "
+	       "mode (%u)\n"
+	       "  -c, --changes-only  only publish status values that "
+	       "changed\n"
+	       "  -a, --max-age       with -c, republish unchanged values "
+	       "after max_age seconds\n"
+	       "  -r, --retain        publish status topics retained\n"
+	       "  -s, --snapshot      publish a retained JSON snapshot of "
+	       "each device\n"
+	       "  -j, --json          publish status reports as JSON state "
+	       "objects\n"
+	       "  -b, --spool         messages kept while the broker is "
+	       "unreachable (%u)\n"
+	       "  -B, --spool-file    file that keeps unpublished messages "
+	       "across restarts\n"
+	       "  -I, --client-id     MQTT client id\n"
+	       "  -P, --persistent    persistent MQTT session, requires -I, "
+	       "not with -5\n"
+	       "  -Q, --qos           QoS of status, ack and set topics, "
+	       "e.g. 0,1,1 (0,0,0)\n"
+	       "  -k, --keepalive     MQTT keepalive in seconds (%u)\n"
+	       "  -m, --max-inflight  QoS > 0 messages in flight at once, "
+	       "0: unlimited (%u)\n"
+	       "  -5, --mqtt5         speak MQTT v5, commands may carry a "
+	       "priority property\n"
+	       "  -w, --window        commands the FHZ may hold "
+	       "unacknowledged (%u)\n"
+	       "  -i, --interval      ms between two commands sent to the "
+	       "FHZ (%u)\n"
+	       "  -F, --fair-share    a lower priority goes next after it "
+	       "was passed over\n"
+	       "                      by this many frames, 0: never (%u)\n"
+	       "      --queue-size    commands queued or in flight per FHZ "
+	       "(%u)\n"
+	       "      --timeout       ms until an unacknowledged command is "
+	       "sent again (%u)\n"
+	       "      --retries       times a command is sent again before "
+	       "it is given up (%u)\n"
+	       "      --hold          ms low priority commands wait for more "
+	       "to the same FHT (%u)\n"
+	       "  -R, --record        append received and sent frames to a "
+	       "binary recording\n"
+	       "  -p, --prefetch      request the state of FHTs at startup, "
+	       "e.g. 9601,9602\n"
+	       "  -K, --clock-sync    set the clocks of all known FHTs every "
+	       "this many minutes\n"
+	       "  -D, --device-state  keep the state of all devices in a "
+	       "file across restarts\n"
+	       "  -l, --log-level     error, warning, notice, info or debug\n"
+	       "  -S, --syslog        log to syslog instead of stderr\n"
+	       "  -A, --log-async     log asynchronously from a separate "
+	       "thread\n",
+	       MQTT_DEFAULT_HOSTNAME, MQTT_DEFAULT_PORT, mqtt_config.prefix,
+	       RXQ_DEFAULT_SIZE, mqtt_config.spool, mqtt_config.keepalive,
+	       mqtt_config.max_inflight, txq_config.window, txq_config.interval,
+	       txq_config.share, txq_config.size, txq_config.timeout,
+	       txq_config.retries, txq_config.hold);
 	exit(code);
 }
 
-int main(int argc, const char **argv)
+static int parse_uint(const char *arg, unsigned int *value)
 {
-	const char *username = NULL, *password = NULL;
-	const char *hostname = MQTT_DEFAULT_HOSTNAME;
-	unsigned int port = MQTT_DEFAULT_PORT;
-	struct mosquitto *mosquitto;
-	struct fhz_message message;
-	int err, fd;
+	unsigned long tmp;
+	char *end;
 
-	if (argc < 4 && argc != 2)
-		usage(-EINVAL);
+	errno = 0;
+	tmp = strtoul(arg, &end, 10);
+	if (!*arg || *end || errno || tmp > UINT_MAX)
+		return -EINVAL;
+	*value = tmp;
 
-	if (argc >= 3)
-		hostname = argv[2];
+	return 0;
+}
 
-	if (argc >= 4)
-		port = strtoul(argv[3], NULL, 10);
+/* for sizes and timeouts that would stall everything at 0 */
+static int parse_nonzero(const char *arg, unsigned int *value)
+{
+	unsigned int tmp;
+	int err;
+
+	err = parse_uint(arg, &tmp);
+	if (err)
+		return err;
+	if (!tmp)
+		return -EINVAL;
+	*value = tmp;
+
+	return 0;
+}
+
+static const char *option_name(int opt)
+{
+	const struct option *option;
+
+	for (option = options; option->name; option++)
+		if (option->val == opt)
+			break;
+
+	return option->name;
+}
+
+static bool config_loading;
+
+static int handle_option(int opt, const char *arg)
+{
+	int err;
 
-	if (argc == 6) {
-		username = argv[4];
-		password = argv[5];
+	switch (opt) {
+	case 'C':
+		/* configuration files don't nest */
+		if (config_loading)
+			return -EINVAL;
+		config_loading = true;
+		err = config_load(arg, options, handle_option);
+		config_loading = false;
+		return err;
+	case OPT_SERIAL:
+		config.serial = strdup(arg);
+		return config.serial ? 0 : -ENOMEM;
+	case OPT_HOST:
+		config.hostname = arg;
+		return 0;
+	case OPT_PORT:
+		return parse_uint(arg, &config.port);
+	case OPT_USERNAME:
+		config.username = arg;
+		return 0;
+	case OPT_PASSWORD:
+		config.password = arg;
+		return 0;
+	case 'T':
+		mqtt_config.prefix = arg;
+		return 0;
+	case 't':
+		config.threaded = true;
+		return 0;
+	case 'q':
+		return parse_uint(arg, &config.rxq_size);
+	case 'c':
+		mqtt_config.changes_only = true;
+		return 0;
+	case 'a':
+		return parse_uint(arg, &mqtt_config.max_age);
+	case 'r':
+		mqtt_config.retain = true;
+		return 0;
+	case 's':
+		mqtt_config.snapshot = true;
+		return 0;
+	case 'j':
+		mqtt_config.json = true;
+		return 0;
+	case 'b':
+		return parse_uint(arg, &mqtt_config.spool);
+	case 'B':
+		mqtt_config.spool_file = arg;
+		return 0;
+	case 'I':
+		mqtt_config.client_id = arg;
+		return 0;
+	case 'P':
+		mqtt_config.persistent = true;
+		return 0;
+	case 'Q':
+		return mqtt_parse_qos(arg);
+	case 'k':
+		return parse_uint(arg, &mqtt_config.keepalive);
+	case 'm':
+		return parse_uint(arg, &mqtt_config.max_inflight);
+	case '5':
+		mqtt_config.v5 = true;
+		return 0;
+	case 'w':
+		return parse_nonzero(arg, &txq_config.window);
+	case 'i':
+		return parse_uint(arg, &txq_config.interval);
+	case 'F':
+		return parse_uint(arg, &txq_config.share);
+	case OPT_QUEUE_SIZE:
+		return parse_nonzero(arg, &txq_config.size);
+	case OPT_TIMEOUT:
+		return parse_nonzero(arg, &txq_config.timeout);
+	case OPT_RETRIES:
+		err = parse_uint(arg, &txq_config.retries);
+		if (err)
+			return err;
+		/* counted per command in a byte */
+		return txq_config.retries > 255 ? -EINVAL : 0;
+	case OPT_HOLD:
+		return parse_uint(arg, &txq_config.hold);
+	case 'R':
+		config.recording = arg;
+		return 0;
+	case 'p':
+		config.prefetch = arg;
+		return 0;
+	case 'K':
+		return parse_uint(arg, &config.clock_sync);
+	case 'D':
+		config.devices = arg;
+		return 0;
+	case 'l':
+		err = log_parse_level(arg);
+		if (err < 0)
+			return err;
+		log_level = err;
+		return 0;
+	case 'S':
+		config.log_sink = LOG_SINK_SYSLOG;
+		return 0;
+	case 'A':
+		config.log_async = true;
+		return 0;
+	case 'h':
+		usage(0);
+	default:
+		return -EINVAL;
 	}
+}
+
+static struct mosquitto *mosquitto;
 
-	fd = fhz_open_serial(argv[1]);
-	if (fd < 0)
-		return fd;
+/* an FHZ and how the main loop receives from it */
+struct port {
+	const char *device;
+	struct fhz *fhz;
+	struct loop_fd serial;
+	/* reopens the FHZ after it was lost, see port_lost() */
+	struct loop_timer retry;
+	unsigned int backoff;
+	/* threaded mode, each port has a receive thread and queue */
+	struct rxq rxq;
+	struct loop_fd queue;
+	pthread_t thread;
+	bool running;
+	atomic_bool hangup;
+};
+
+static struct port ports[FHZ_PORTS_MAX];
+static unsigned int num_ports;
+static atomic_bool rx_stop;
+
+static void handle_message(struct fhz_message *message)
+{
+	struct fhz *fhz = fhz_port(message->port);
+	struct txq_trace trace;
+	bool traced = false;
+	int err;
 
-	err = mqtt_init(&mosquitto, fd, hostname, port, username, password);
+	/* the FHZ works, the next time it is lost is a new failure */
+	ports[message->port].backoff = 0;
+
+	/* the device table is only ever touched from the main thread */
+	err = fhz_update(message);
 	if (err) {
-		fprintf(stderr, "MQTT connection failure\n");
-		goto close_out;
+		if (err != -ENODATA)
+			error("%s: error decoding packet: %s\n",
+			      ports[message->port].device, strerror(-err));
+		return;
+	}
+
+	if (message->machine == FHT && message->fht.type == ACK)
+		traced = txq_ack(fhz->txq, &message->fht.hauscode,
+				 message->fht.function_id, message->received,
+				 &trace);
+
+	/* spooled messages are timed once they are actually published */
+	err = mqtt_publish(mosquitto, message);
+	if (!err)
+		metric_observe(METRIC_RX_PUBLISH_LATENCY,
+			       metrics_now() - message->received);
+	else if (err != -EAGAIN)
+		error("mqtt: unable to publish FHZ message\n");
+
+	if (!traced)
+		return;
+
+	/* an upload of the weekly program completes with its last write */
+	if (trace.upload) {
+		if (txq_program_pending(fhz->txq, trace.upload))
+			return;
+		err = mqtt_publish_program(mosquitto, &message->fht.hauscode,
+					   trace.id, trace.failed);
+		if (err)
+			error("mqtt: unable to publish program: %s\n",
+			      strerror(-err));
+	} else if (trace.id[0]) {
+		err = mqtt_publish_ack_id(mosquitto, &message->fht, trace.id);
+		if (err)
+			error("mqtt: unable to publish ack of %s: %s\n",
+			      trace.id, strerror(-err));
 	}
+}
+
+/* the last write of a program upload was given up, report the upload */
+static void handle_dropped(struct fhz *fhz, const struct hauscode *hauscode,
+			   unsigned char function_id,
+			   const struct txq_trace *trace)
+{
+	int err;
+
+	if (!trace->upload)
+		return;
+
+	err = mqtt_publish_program(mosquitto, hauscode, trace->id, true);
+	if (err)
+		error("mqtt: unable to publish program: %s\n",
+		      strerror(-err));
+}
+
+/* returns 0 if further frames may follow, the error otherwise */
+static int receive(struct port *port,
+		   void (*handler)(struct port *, struct fhz_message *))
+{
+	struct fhz_message message;
+	int err;
 
+	/* drain every complete frame the FHZ has sent so far */
 	do {
-		err = fhz_handle(fd, &message);
-		if (err && err != -EAGAIN)
-			error("Error decoding packet: %s\n", strerror(-err));
-		else if (!err) {
-			err = mqtt_publish(mosquitto, &message);
-			if (err)
-				fprintf(stderr, "mqtt: unable to publish FHZ "
-						"message\n");
+		err = fhz_handle(port->fhz, &message);
+		if (!err)
+			handler(port, &message);
+		else if (err == -EINVAL)
+			error("%s: error decoding packet: %s\n", port->device,
+			      strerror(-err));
+	} while (!err || err == -EINVAL);
+
+	return err == -EAGAIN ? 0 : err;
+}
+
+static void handle_port_message(struct port *port,
+				struct fhz_message *message)
+{
+	handle_message(message);
+}
+
+static void port_lost(struct port *port);
+
+static void fhz_ready(struct loop_fd *watch, short revents)
+{
+	struct port *port = container_of(watch, struct port, serial);
+
+	if (receive(port, handle_port_message))
+		port_lost(port);
+}
+
+static void rx_enqueue(struct port *port, struct fhz_message *message)
+{
+	rxq_push(&port->rxq, message);
+}
+
+/* the receive thread owns the serial fd of its port for reading */
+static void *rx_thread(void *arg)
+{
+	struct port *port = arg;
+	struct pollfd pfd = {
+		.fd = port->fhz->fd,
+		.events = POLLIN,
+	};
+	int err;
+
+	err = metrics_thread_init();
+	if (err)
+		warning("receive thread: metrics: %s\n", strerror(-err));
+
+	while (!atomic_load(&rx_stop)) {
+		err = poll(&pfd, 1, 1000);
+		if (err == -1 && errno != EINTR) {
+			error("poll %s: %s\n", port->device, strerror(errno));
+			break;
+		} else if (err <= 0)
+			continue;
+
+		if (receive(port, rx_enqueue))
+			break;
+	}
+
+	atomic_store(&port->hangup, true);
+	rxq_push(&port->rxq, &(struct fhz_message){ .machine = FHZ_NONE });
+
+	return NULL;
+}
+
+static void rxq_ready(struct loop_fd *watch, short revents)
+{
+	struct port *port = container_of(watch, struct port, queue);
+	struct fhz_message message;
+
+	rxq_ack(&port->rxq);
+	while (rxq_pop(&port->rxq, &message))
+		if (message.machine != FHZ_NONE)
+			handle_message(&message);
+
+	if (atomic_load(&port->hangup))
+		port_lost(port);
+}
+
+/* receives from the open FHZ of a port, in the main loop or a thread */
+static int port_start(struct port *port)
+{
+	int err;
+
+	if (!port->rxq.ring) {
+		port->serial.fd = port->fhz->fd;
+		return 0;
+	}
+
+	atomic_store(&port->hangup, false);
+	err = -pthread_create(&port->thread, NULL, rx_thread, port);
+	if (err) {
+		error("%s: receive thread: %s\n", port->device,
+		      strerror(-err));
+		return err;
+	}
+	port->running = true;
+
+	return 0;
+}
+
+static void port_retry(struct port *port)
+{
+	if (!port->backoff)
+		port->backoff = PORT_BACKOFF_MIN;
+	else if (port->backoff < PORT_BACKOFF_MAX / 2)
+		port->backoff *= 2;
+	else
+		port->backoff = PORT_BACKOFF_MAX;
+
+	warning("%s: reopening in %u ms\n", port->device, port->backoff);
+	loop_timer_add(&port->retry, port->backoff);
+}
+
+/*
+ * A read error is fatal to the fd, e.g. an unplugged USB stick or a TCP
+ * connection that was reset. The port is closed and reopened, commands are
+ * retried by the transmit queue in the meantime.
+ */
+static void port_lost(struct port *port)
+{
+	/* the receive queue may report the hangup more than once */
+	if (port->fhz->fd < 0)
+		return;
+
+	port->serial.fd = -1;
+	if (port->running) {
+		pthread_join(port->thread, NULL);
+		port->running = false;
+	}
+
+	close(port->fhz->fd);
+	port->fhz->fd = -1;
+	port_retry(port);
+}
+
+static void port_reopen(struct loop_timer *timer)
+{
+	struct port *port = container_of(timer, struct port, retry);
+	int fd;
+
+	fd = fhz_open(port->device);
+	if (fd < 0) {
+		port_retry(port);
+		return;
+	}
+
+	/* a frame that was cut off by the loss never completes */
+	memset(&port->fhz->rx, 0, sizeof(port->fhz->rx));
+	port->fhz->fd = fd;
+	if (port_start(port)) {
+		close(fd);
+		port->fhz->fd = -1;
+		port_retry(port);
+		return;
+	}
+
+	info("%s: reopened\n", port->device);
+	if (port->fhz->txq)
+		txq_resume(port->fhz->txq);
+}
+
+/* queue statistics are summed up over all ports */
+static void publish_stats(struct loop_timer *timer)
+{
+	unsigned long depth = 0, max_depth = 0, overflow = 0, txq = 0;
+	bool threaded = false;
+	unsigned int i;
+
+	for (i = 0; i < num_ports; i++) {
+		txq += txq_depth(ports[i].fhz->txq);
+		if (!ports[i].rxq.ring)
+			continue;
+
+		threaded = true;
+		depth += rxq_depth(&ports[i].rxq);
+		if (atomic_load(&ports[i].rxq.max_depth) > max_depth)
+			max_depth = atomic_load(&ports[i].rxq.max_depth);
+		overflow += atomic_load(&ports[i].rxq.overflow);
+	}
+
+	if (threaded) {
+		mqtt_publish_sys(mosquitto, "rxq/depth", depth);
+		mqtt_publish_sys(mosquitto, "rxq/max-depth", max_depth);
+		mqtt_publish_sys(mosquitto, "rxq/overflow", overflow);
+	}
+	mqtt_publish_sys(mosquitto, "txq/depth", txq);
+	metrics_publish(mosquitto);
+
+	loop_timer_add(timer, STATS_INTERVAL);
+}
+
+/* opens a comma separated list of serial ports */
+static int ports_open(char *devices)
+{
+	struct port *port;
+	char *device;
+	int err, fd;
+
+	for (device = strtok(devices, ","); device;
+	     device = strtok(NULL, ",")) {
+		if (num_ports == FHZ_PORTS_MAX) {
+			error("at most " __stringify(FHZ_PORTS_MAX)
+			      " FHZ are supported\n");
+			return -E2BIG;
+		}
+
+		fd = fhz_open(device);
+		if (fd < 0)
+			return fd;
+
+		port = &ports[num_ports];
+		port->device = device;
+		port->fhz = fhz_add(fd);
+		err = txq_init(&port->fhz->txq, port->fhz, handle_dropped);
+		if (err) {
+			error("%s: transmit queue: %s\n", device,
+			      strerror(-err));
+			close(fd);
+			return err;
+		}
+		num_ports++;
+	}
+
+	return num_ports ? 0 : -EINVAL;
+}
+
+static void ports_close(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_ports; i++) {
+		txq_close(ports[i].fhz->txq);
+		if (ports[i].fhz->fd >= 0)
+			close(ports[i].fhz->fd);
+	}
+}
+
+static int ports_start(bool threaded, unsigned int rxq_size)
+{
+	struct port *port;
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < num_ports; i++) {
+		port = &ports[i];
+		port->retry.handler = port_reopen;
+		if (!threaded) {
+			port->serial.events = POLLIN;
+			port->serial.handler = fhz_ready;
+			loop_fd_add(&port->serial);
+			port_start(port);
+			continue;
 		}
 
-		err = mqtt_handle(mosquitto);
+		err = rxq_init(&port->rxq, rxq_size);
+		if (err) {
+			error("%s: receive queue: %s\n", port->device,
+			      strerror(-err));
+			return err;
+		}
+
+		err = port_start(port);
+		if (err) {
+			rxq_destroy(&port->rxq);
+			return err;
+		}
+
+		port->queue.fd = port->rxq.event_fd;
+		port->queue.events = POLLIN;
+		port->queue.handler = rxq_ready;
+		loop_fd_add(&port->queue);
+	}
+
+	return 0;
+}
+
+static void ports_stop(void)
+{
+	unsigned int i;
+
+	atomic_store(&rx_stop, true);
+	for (i = 0; i < num_ports; i++) {
+		loop_timer_del(&ports[i].retry);
+		if (ports[i].running) {
+			pthread_join(ports[i].thread, NULL);
+			ports[i].running = false;
+		}
+		if (ports[i].rxq.ring)
+			rxq_destroy(&ports[i].rxq);
+	}
+}
+
+static void terminate(int signal)
+{
+	loop_stop();
+}
+
+int main(int argc, char **argv)
+{
+	struct loop_timer stats = {
+		.handler = publish_stats,
+	};
+	int err, opt;
+
+	while ((opt = getopt_long(argc, argv, OPTIONS, options, NULL)) != -1) {
+		/* getopt_long() already complained about unknown options */
+		if (opt == '?')
+			usage(-EINVAL);
+		err = handle_option(opt, optarg);
+		if (err == -EINVAL && opt != 'C')
+			error("--%s: invalid argument %s\n",
+			      option_name(opt), optarg);
 		if (err)
-			error("MQTT error: %s\n", strerror(-err));
+			usage(err);
+	}
+
+	/* positional arguments, kept for compatibility */
+	argc -= optind;
+	argv += optind;
+	if (argc > 5)
+		usage(-EINVAL);
+	if (argc >= 1)
+		config.serial = argv[0];
+	if (argc >= 2)
+		config.hostname = argv[1];
+	if (argc >= 3 && parse_uint(argv[2], &config.port))
+		usage(-EINVAL);
+	if (argc >= 4)
+		config.username = argv[3];
+	if (argc == 5)
+		config.password = argv[4];
+
+	if (!config.serial)
+		usage(-EINVAL);
+
+	err = log_init(config.log_sink, config.log_async);
+	if (err) {
+		error("logging: %s\n", strerror(-err));
+		return err;
+	}
+
+	if (config.devices) {
+		err = fht_devices_open(config.devices);
+		if (err) {
+			error("device state %s: %s\n", config.devices,
+			      strerror(-err));
+			goto log_out;
+		}
+	}
+
+	err = ports_open(config.serial);
+	if (err)
+		goto close_out;
+
+	if (config.recording) {
+		err = record_open(config.recording);
+		if (err) {
+			error("recording %s: %s\n", config.recording,
+			      strerror(-err));
+			goto close_out;
+		}
+	}
+
+	err = mqtt_init(&mosquitto, config.hostname, config.port,
+			config.username, config.password);
+	if (err) {
+		error("MQTT setup failure: %s\n", strerror(-err));
+		goto record_out;
+	}
+
+	signal(SIGINT, terminate);
+	signal(SIGTERM, terminate);
+
+	err = ports_start(config.threaded, config.rxq_size);
+	if (err)
+		goto stop_out;
+	loop_timer_add(&stats, STATS_INTERVAL);
 
-		sleep(1);
-	} while(true);
+	if (config.prefetch) {
+		err = prefetch_start(config.prefetch);
+		if (err) {
+			error("prefetch %s: invalid hauscodes\n",
+			      config.prefetch);
+			goto stop_out;
+		}
+	}
+
+	if (config.clock_sync) {
+		err = clocksync_start(config.clock_sync);
+		if (err) {
+			error("clock sync: invalid interval %u\n",
+			      config.clock_sync);
+			goto stop_out;
+		}
+	}
 
-	err = 0;
+	err = loop_run();
+	if (err)
+		error("Main loop: %s\n", strerror(-err));
 
+stop_out:
+	clocksync_stop();
+	prefetch_stop();
+	ports_stop();
 	mqtt_close(mosquitto);
+record_out:
+	record_close();
 close_out:
-	close(fd);
+	ports_close();
+	fht_devices_close();
+log_out:
+	log_close();
 	return err;
 }
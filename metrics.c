@@ -0,0 +1,196 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+
+#include "fhz.h"
+#include "mqtt.h"
+
+/* the main thread, one receive thread per FHZ and a spare */
+#define METRICS_THREADS (FHZ_PORTS_MAX + 2)
+
+static struct metrics metrics[METRICS_THREADS];
+static atomic_uint metrics_threads = 1;
+
+_Thread_local struct metrics *metrics_self = &metrics[0];
+
+static const char *const metric_names[METRICS] = {
+	[METRIC_RX_FRAMES] = "rx/frames",
+	[METRIC_RX_MAGIC_ERRORS] = "rx/magic-errors",
+	[METRIC_RX_LENGTH_ERRORS] = "rx/length-errors",
+	[METRIC_RX_CHECKSUM_ERRORS] = "rx/checksum-errors",
+	[METRIC_TX_FRAMES] = "tx/frames",
+	[METRIC_TX_ERRORS] = "tx/errors",
+	[METRIC_DECODE_UNKNOWN] = "decode/unknown",
+	[METRIC_PUBLISH_OK] = "publish/ok",
+	[METRIC_PUBLISH_FAILED] = "publish/failed",
+	[METRIC_MQTT_RECONNECTS] = "mqtt/reconnects",
+	[METRIC_SPOOLED] = "mqtt/spooled",
+	[METRIC_SPOOL_DROPPED] = "mqtt/spool-dropped",
+};
+
+static const char *const metric_histogram_names[METRIC_HISTOGRAMS] = {
+	[METRIC_RX_PUBLISH_LATENCY] = "latency/rx-publish",
+	[METRIC_TXQ_WAIT_HIGH] = "txq/wait/high",
+	[METRIC_TXQ_WAIT_LOW] = "txq/wait/low",
+	[METRIC_TXQ_WAIT_IDLE] = "txq/wait/idle",
+};
+
+int metrics_thread_init(void)
+{
+	unsigned int slot;
+
+	slot = atomic_fetch_add(&metrics_threads, 1);
+	if (slot >= METRICS_THREADS) {
+		/* counting still works, but may lose updates */
+		atomic_fetch_sub(&metrics_threads, 1);
+		return -ENOSPC;
+	}
+	metrics_self = &metrics[slot];
+
+	return 0;
+}
+
+static unsigned long metrics_sum(const atomic_ulong *counter)
+{
+	unsigned long sum = 0;
+	unsigned int i;
+
+	/* the same counter lives at the same offset in each block */
+	for (i = 0; i < METRICS_THREADS; i++)
+		sum += atomic_load_explicit((const atomic_ulong *)
+			((const char *)counter + i * sizeof(struct metrics)),
+			memory_order_relaxed);
+
+	return sum;
+}
+
+static unsigned long histogram_count(const unsigned long *buckets)
+{
+	unsigned long count = 0;
+	unsigned int i;
+
+	for (i = 0; i < METRIC_BUCKETS; i++)
+		count += buckets[i];
+
+	return count;
+}
+
+unsigned long metric_histogram_percentile(const unsigned long *buckets,
+					  unsigned int percentile)
+{
+	unsigned long count, sum = 0;
+	unsigned int i;
+
+	count = histogram_count(buckets);
+	if (!count)
+		return 0;
+
+	for (i = 0; i < METRIC_BUCKETS; i++) {
+		sum += buckets[i];
+		if (sum * 100 >= count * percentile)
+			break;
+	}
+
+	return 1UL << (i < METRIC_BUCKETS - 1 ? i : METRIC_BUCKETS - 1);
+}
+
+static void metrics_publish_histogram(struct mosquitto *mosquitto,
+				      const char *name,
+				      const unsigned long *buckets)
+{
+	static const unsigned int percentiles[] = {50, 90, 99};
+	unsigned long count = histogram_count(buckets);
+	char topic[64];
+	unsigned int i;
+
+	snprintf(topic, sizeof(topic), "%s/count", name);
+	mqtt_publish_sys(mosquitto, topic, count);
+	if (!count)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(percentiles); i++) {
+		snprintf(topic, sizeof(topic), "%s/p%u-us", name,
+			 percentiles[i]);
+		mqtt_publish_sys(mosquitto, topic,
+				 metric_histogram_percentile(buckets,
+							     percentiles[i]));
+	}
+}
+
+static void metrics_publish_fht(struct mosquitto *mosquitto)
+{
+	static const char *const names[FHT_LATENCIES] = {
+		[FHT_LATENCY_QUEUE] = "queue",
+		[FHT_LATENCY_RF] = "rf",
+		[FHT_LATENCY_TOTAL] = "total",
+	};
+	unsigned long buckets[METRIC_BUCKETS];
+	struct fht_device *device;
+	struct hauscode hauscode;
+	unsigned int i, j;
+	char name[64];
+
+	for_each_fht_device(device) {
+		hauscode = fht_device_hauscode(device);
+		for (i = 0; i < FHT_LATENCIES; i++) {
+			for (j = 0; j < METRIC_BUCKETS; j++)
+				buckets[j] = atomic_load_explicit(
+					&device->latency[i].bucket[j],
+					memory_order_relaxed);
+			/* most devices are never sent a command */
+			if (!histogram_count(buckets))
+				continue;
+
+			snprintf(name, sizeof(name), "fht/%02u%02u/latency/%s",
+				 hauscode.upper, hauscode.lower, names[i]);
+			metrics_publish_histogram(mosquitto, name, buckets);
+		}
+	}
+}
+
+void metrics_publish(struct mosquitto *mosquitto)
+{
+	unsigned long value, buckets[METRIC_BUCKETS];
+	unsigned int i, j;
+	char topic[32];
+
+	for (i = 0; i < METRICS; i++)
+		mqtt_publish_sys(mosquitto, metric_names[i],
+				 metrics_sum(&metrics[0].counters[i]));
+
+	/* only function ids that ever failed, there are 256 of them */
+	for (i = 0; i < 256; i++) {
+		value = metrics_sum(&metrics[0].decode_invalid[i]);
+		if (value) {
+			snprintf(topic, sizeof(topic), "decode/invalid/%02x", i);
+			mqtt_publish_sys(mosquitto, topic, value);
+		}
+
+		value = metrics_sum(&metrics[0].decode_again[i]);
+		if (value) {
+			snprintf(topic, sizeof(topic), "decode/again/%02x", i);
+			mqtt_publish_sys(mosquitto, topic, value);
+		}
+	}
+
+	for (i = 0; i < METRIC_HISTOGRAMS; i++) {
+		for (j = 0; j < METRIC_BUCKETS; j++)
+			buckets[j] = metrics_sum(
+				&metrics[0].histograms[i].bucket[j]);
+		metrics_publish_histogram(mosquitto, metric_histogram_names[i],
+					  buckets);
+	}
+
+	metrics_publish_fht(mosquitto);
+}
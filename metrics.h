@@ -0,0 +1,123 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+struct mosquitto;
+
+/*
+ * Counters of the bridge internals, published below /fhz/sys/. Every thread
+ * that counts owns a block of counters, so counting is a plain load and
+ * store without any locked instruction. Blocks are only summed up when
+ * publishing.
+ */
+enum metric {
+	METRIC_RX_FRAMES,
+	METRIC_RX_MAGIC_ERRORS,
+	METRIC_RX_LENGTH_ERRORS,
+	METRIC_RX_CHECKSUM_ERRORS,
+	METRIC_TX_FRAMES,
+	METRIC_TX_ERRORS,
+	METRIC_DECODE_UNKNOWN, /* frames no decoder claims, bad FHT lengths */
+	METRIC_PUBLISH_OK,
+	METRIC_PUBLISH_FAILED,
+	METRIC_MQTT_RECONNECTS,
+	METRIC_SPOOLED, /* messages kept while the broker was away */
+	METRIC_SPOOL_DROPPED,
+	METRICS,
+};
+
+enum metric_histogram {
+	METRIC_RX_PUBLISH_LATENCY, /* frame received until published */
+	/* command queued until first sent, in the order of enum txq_priority */
+	METRIC_TXQ_WAIT_HIGH,
+	METRIC_TXQ_WAIT_LOW,
+	METRIC_TXQ_WAIT_IDLE,
+	METRIC_HISTOGRAMS,
+};
+
+/*
+ * bucket i counts values below 2^i us, the last one is unbounded. That's
+ * more than half an hour, FHTs may take minutes to acknowledge commands.
+ */
+#define METRIC_BUCKETS 32
+
+struct metric_histogram_buckets {
+	atomic_ulong bucket[METRIC_BUCKETS];
+};
+
+struct metrics {
+	atomic_ulong counters[METRICS];
+	/* fht_decode() errors per function_id */
+	atomic_ulong decode_invalid[256];
+	atomic_ulong decode_again[256];
+	struct metric_histogram_buckets histograms[METRIC_HISTOGRAMS];
+};
+
+/* all threads start counting into the block of the main thread */
+extern _Thread_local struct metrics *metrics_self;
+
+static inline void __metric_add(atomic_ulong *counter, unsigned long n)
+{
+	/* only the owning thread writes, a locked add isn't needed */
+	atomic_store_explicit(counter,
+			      atomic_load_explicit(counter,
+						   memory_order_relaxed) + n,
+			      memory_order_relaxed);
+}
+
+#define metric_add(__metric, __n) \
+	__metric_add(&metrics_self->counters[__metric], __n)
+#define metric_inc(__metric) metric_add(__metric, 1)
+
+static inline void metric_decode_error(unsigned char function_id, int err)
+{
+	if (err == -EINVAL)
+		__metric_add(&metrics_self->decode_invalid[function_id], 1);
+	else if (err == -EAGAIN)
+		__metric_add(&metrics_self->decode_again[function_id], 1);
+}
+
+static inline uint64_t metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void
+metric_histogram_add(struct metric_histogram_buckets *histogram, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	unsigned int i;
+
+	i = us ? 64 - __builtin_clzll(us) : 0;
+	if (i >= METRIC_BUCKETS)
+		i = METRIC_BUCKETS - 1;
+	__metric_add(&histogram->bucket[i], 1);
+}
+
+#define metric_observe(__histogram, __ns) \
+	metric_histogram_add(&metrics_self->histograms[__histogram], __ns)
+
+/* to be called by every thread that counts, before it counts */
+int metrics_thread_init(void);
+
+/* upper bound in us of the bucket that holds the given percentile */
+unsigned long metric_histogram_percentile(const unsigned long *buckets,
+					  unsigned int percentile);
+
+void metrics_publish(struct mosquitto *mosquitto);
@@ -10,104 +10,712 @@
  * the COPYING file in the top-level directory.
  */
 
+#include <ctype.h>
 #include <errno.h>
 #include <mosquitto.h>
+#include <mqtt_protocol.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include "mqtt.h"
 #include "fhz.h"
+#include "loop.h"
+#include "txq.h"
 
-#define S_FHZ "fhz/"
 #define S_FHT "fht/"
+#define S_FS20 "fs20/"
 #define S_SET "set/"
+#define S_SYS "sys/"
 
-#define TOPIC "/" S_FHZ
-#define TOPIC_SUBSCRIBE TOPIC S_SET
-#define TOPIC_FHT TOPIC S_FHT
+/* topics are below mqtt_config.prefix */
+#define MQTT_TOPIC_MAX (MQTT_PREFIX_MAX + 64)
+
+/* mosquitto_loop_misc() handles pings and retries, once a second is enough */
+#define MQTT_MISC_INTERVAL 1000
+
+/* ms after which a transmission without FHT_END_XMIT is considered done */
+#define MQTT_BURST_TIMEOUT 10000
+
+/* ms between two connection attempts, doubled after every failure */
+#define MQTT_BACKOFF_MIN 1000
+#define MQTT_BACKOFF_MAX (60 * 1000)
+
+#define MQTT_SPOOL_MAGIC "FHZSPL1\n"
+#define MQTT_SPOOL_MAGIC_LEN (sizeof(MQTT_SPOOL_MAGIC) - 1)
+
+struct mqtt_config mqtt_config = {
+	.prefix = "/fhz/",
+	.spool = 1024,
+	.keepalive = 120,
+	.max_inflight = 20,
+};
+
+static struct mosquitto *mqtt_mosquitto;
+static struct loop_fd mqtt_watch;
+static struct loop_timer mqtt_timer;
+static struct loop_timer mqtt_retry_timer;
+static unsigned int mqtt_backoff;
+static bool mqtt_connected;
+/* the device table of a warm start was published, see mqtt_on_connect() */
+static bool mqtt_restored;
+
+/*
+ * Decoded messages that arrived while the broker was unreachable, published
+ * once it is back. If the spool runs full, the oldest message is dropped.
+ */
+static struct {
+	struct fhz_message *ring;
+	unsigned int first;
+	unsigned int count;
+} mqtt_spool;
 
 static int mqtt_subscribe(struct mosquitto *mosquitto)
 {
-	return mosquitto_subscribe(mosquitto, NULL, TOPIC_SUBSCRIBE "#", 0);
+	char topic[MQTT_TOPIC_MAX];
+
+	snprintf(topic, sizeof(topic), "%s" S_SET "#", mqtt_config.prefix);
+	return mosquitto_subscribe(mosquitto, NULL, topic,
+				   mqtt_config.qos[MQTT_QOS_SET]);
 }
 
-static int mqtt_receive_fht(int fd, const char *topic, const char *payload)
-{
+/* a weekly program in JSON with some whitespace fits easily */
+#define MQTT_PAYLOAD_MAX 512
+
+/* "fht/<hauscode>/" */
+#define MQTT_ROUTE_FHT_COMMAND (sizeof(S_FHT) - 1 + 5)
+
+/* a command topic below <prefix>/set/, without the correlation id */
+struct mqtt_route {
+	char topic[MQTT_ROUTE_FHT_COMMAND + FHT_TOPIC_LEN];
 	struct hauscode hauscode;
-	char buffer[5];
+	unsigned char function_id;
+	bool program; /* the weekly program, instead of a register */
+};
 
-	if (strlen(topic) < 6)
-		return -EINVAL;
+/*
+ * Resolved command topics. Direct mapped, a miss replaces the slot. Bulk
+ * uploads send many commands to the same few topics, they resolve them once.
+ */
+#define MQTT_ROUTES 64
+
+static struct mqtt_route mqtt_routes[MQTT_ROUTES];
 
-	memcpy(buffer, topic, 4);
-	buffer[4] = 0;
-	if (hauscode_from_string(buffer, &hauscode))
+static int mqtt_route_fht(struct mqtt_route *route, char *topic)
+{
+	int function_id;
+
+	if (memcmp(topic, S_FHT, sizeof(S_FHT) - 1) ||
+	    topic[MQTT_ROUTE_FHT_COMMAND - 1] != '/')
 		return -EINVAL;
 
-	if (topic[4] != '/')
+	topic[MQTT_ROUTE_FHT_COMMAND - 1] = 0;
+	if (hauscode_from_string(topic + sizeof(S_FHT) - 1, &route->hauscode))
 		return -EINVAL;
 
-	topic += 5;
+	route->program = !strcmp(topic + MQTT_ROUTE_FHT_COMMAND, "program");
+	if (route->program)
+		return 0;
+
+	function_id = fht_command_id(topic + MQTT_ROUTE_FHT_COMMAND);
+	if (function_id < 0)
+		return function_id;
+
+	route->function_id = function_id;
+
+	return 0;
+}
+
+/*
+ * Splits "fht/<hauscode>/<command>[/<id>]" in one pass over the topic,
+ * and resolves it from the cache if it was seen before.
+ */
+static const struct mqtt_route *mqtt_route(const char *topic, const char **id)
+{
+	unsigned int hash = 2166136261u, levels = 0;
+	char buffer[sizeof(mqtt_routes[0].topic)];
+	struct mqtt_route *route, resolved;
+	const char *c;
+	size_t len;
+
+	/* FNV-1a over everything up to the correlation id */
+	for (c = topic; *c; c++) {
+		if (*c == '/' && ++levels == 3)
+			break;
+		hash = (hash ^ (unsigned char)*c) * 16777619u;
+	}
+	len = c - topic;
+	*id = *c ? c + 1 : NULL;
+
+	if (len <= MQTT_ROUTE_FHT_COMMAND || len >= sizeof(buffer))
+		return NULL;
+
+	route = &mqtt_routes[hash % MQTT_ROUTES];
+	if (!memcmp(route->topic, topic, len) && !route->topic[len])
+		return route;
+
+	memcpy(buffer, topic, len);
+	buffer[len] = 0;
+	if (mqtt_route_fht(&resolved, buffer))
+		return NULL;
+
+	*route = resolved;
+	memcpy(route->topic, topic, len);
+	route->topic[len] = 0;
 
-	return fht_set(fd, &hauscode, topic, payload);
+	return route;
 }
 
-static void callback(struct mosquitto *mosquitto, void *v_fd,
-		     const struct mosquitto_message *message)
+static int mqtt_receive_program(struct mosquitto *mosquitto,
+				const struct hauscode *hauscode,
+				const char *payload, const char *id, int priority)
 {
-	const char *topic = message->topic + sizeof(TOPIC_SUBSCRIBE) - 1;
-	char buffer[128];
-	const int fd = (int)(size_t)v_fd;
 	int err;
 
-	if (message->payloadlen > 127)
+	err = fht_program(hauscode, payload, id, priority);
+	if (err < 0)
+		return err;
+
+	/* the FHT already has that program, complete right away */
+	if (!err)
+		return mqtt_publish_program(mosquitto, hauscode, id, false);
+
+	return 0;
+}
+
+/*
+ * The class of a command is picked by its topic, an MQTT v5 user property
+ * "priority" overrides it.
+ */
+#define MQTT_PRIORITY_PROPERTY "priority"
+
+static int mqtt_priority(const mosquitto_property *properties)
+{
+	const mosquitto_property *property;
+	int priority = TXQ_PRIO_DEFAULT;
+	char *name, *value;
+
+	property = mosquitto_property_read_string_pair(properties,
+			MQTT_PROP_USER_PROPERTY, &name, &value, false);
+	while (property) {
+		if (!strcmp(name, MQTT_PRIORITY_PROPERTY))
+			priority = txq_parse_priority(value);
+		free(name);
+		free(value);
+		property = mosquitto_property_read_string_pair(property,
+				MQTT_PROP_USER_PROPERTY, &name, &value, true);
+	}
+
+	return priority;
+}
+
+static void callback(struct mosquitto *mosquitto, void *userdata,
+		     const struct mosquitto_message *message,
+		     const mosquitto_property *properties)
+{
+	size_t prefix = strlen(mqtt_config.prefix);
+	const struct mqtt_route *route;
+	char buffer[MQTT_PAYLOAD_MAX];
+	const char *topic, *id;
+	int err, priority;
+
+	/* a persistent session may still deliver topics of another prefix */
+	if (strncmp(message->topic, mqtt_config.prefix, prefix) ||
+	    strncmp(message->topic + prefix, S_SET, sizeof(S_SET) - 1))
+		return;
+	topic = message->topic + prefix + sizeof(S_SET) - 1;
+
+	if (message->payloadlen >= sizeof(buffer))
 		return;
 
 	memcpy(buffer, message->payload, message->payloadlen);
 	buffer[message->payloadlen] = 0;
 
-	if (!strncmp(topic, S_FHT, sizeof(S_FHT) - 1)) {
-		err = mqtt_receive_fht(fd, topic + sizeof(S_FHT) - 1, buffer);
-	} else {
+	route = mqtt_route(topic, &id);
+	priority = mqtt_priority(properties);
+	if (!route || priority < 0)
 		err = -EINVAL;
-	}
+	else if (id && (!*id || strlen(id) >= TXQ_ID_LEN ||
+			strpbrk(id, "/+#")))
+		err = -EINVAL;
+	else if (route->program)
+		err = mqtt_receive_program(mosquitto, &route->hauscode, buffer,
+					   id, priority);
+	else
+		err = fht_set(&route->hauscode, route->function_id, buffer, id,
+			      priority);
 
 	if (err)
-		printf("Unable to parse request: %s\n", strerror(-err));
+		warning("Unable to parse request: %s\n", strerror(-err));
 }
 
-static inline void publish(struct mosquitto *mosquitto, const char *type,
-		           const struct hauscode *hauscode, const char *topic,
-		           const char *value)
+static void publish_raw(struct mosquitto *mosquitto, const char *mqtt_topic,
+			const char *value, int len, enum mqtt_qos_class class,
+			bool retain)
 {
-	char mqtt_topic[64];
-
-	snprintf(mqtt_topic, sizeof(mqtt_topic), TOPIC_FHT "%02u%02u/%s/%s",
-		 hauscode->upper, hauscode->lower, type, topic);
-
-#ifdef DEBUG
-	printf("%s %s\n", mqtt_topic, value);
-#endif
+	debug("%s %.*s\n", mqtt_topic, len, value);
 #ifndef NO_SEND
-	mosquitto_publish(mosquitto, NULL, mqtt_topic, strlen(value), value, 0,
-			  false);
+	if (mosquitto_publish(mosquitto, NULL, mqtt_topic, len, value,
+			      mqtt_config.qos[class], retain) !=
+	    MOSQ_ERR_SUCCESS) {
+		metric_inc(METRIC_PUBLISH_FAILED);
+		return;
+	}
 #endif
+	metric_inc(METRIC_PUBLISH_OK);
+}
+
+/* returns the cache entry of a status topic, NULL if the cache is full */
+static struct fht_topic_cache *mqtt_fht_topic(struct fht_device *device,
+					      const char *topic)
+{
+	struct fht_topic_cache *cache;
+	int i;
 
+	for (i = 0; i < ARRAY_SIZE(device->topics); i++) {
+		cache = &device->topics[i];
+		if (!cache->topic[0]) {
+			strcpy(cache->topic, topic);
+			return cache;
+		}
+		if (!strcmp(cache->topic, topic))
+			return cache;
+	}
+
+	return NULL;
+}
+
+/*
+ * Remembers the value of a status topic. Returns true if it differs from the
+ * last one, or if it is due for a republish.
+ */
+static bool mqtt_fht_changed(struct fht_topic_cache *cache, const char *value)
+{
+	uint64_t now = loop_now();
+
+	if (cache->published && !strcmp(cache->value, value) &&
+	    (!mqtt_config.max_age ||
+	     now - cache->published < mqtt_config.max_age * 1000ULL))
+		return false;
+
+	strcpy(cache->value, value);
+	cache->published = now;
+
+	return true;
+}
+
+static bool is_json_number(const char *value)
+{
+	const char *c = value;
+
+	if (*c == '-')
+		c++;
+	if (!isdigit(*c))
+		return false;
+	while (isdigit(*c) || *c == '.')
+		c++;
+
+	return !*c;
+}
+
+/* formats a JSON object of topic/value pairs */
+static int json_append(char *buffer, size_t size, int len, const char *topic,
+		       const char *value)
+{
+	const char *quote = is_json_number(value) ? "" : "\"";
+
+	return len + snprintf(buffer + len, size - len, "%s\"%s\":%s%s%s",
+			      len > 1 ? "," : "", topic, quote, value, quote);
+}
+
+static void mqtt_fht_object(struct mosquitto *mosquitto,
+			    struct fht_device *device, const char *name,
+			    bool dirty_only, bool retain)
+{
+	char buffer[FHT_DEVICE_TOPICS * (FHT_TOPIC_LEN + 16 + 6) + 3];
+	struct hauscode hauscode = fht_device_hauscode(device);
+	struct fht_topic_cache *cache;
+	char mqtt_topic[MQTT_TOPIC_MAX];
+	int i, len = 1;
+
+	buffer[0] = '{';
+	for (i = 0; i < ARRAY_SIZE(device->topics); i++) {
+		cache = &device->topics[i];
+		if (!cache->topic[0])
+			break;
+		if (dirty_only) {
+			if (!cache->dirty)
+				continue;
+			cache->dirty = false;
+		}
+		len = json_append(buffer, sizeof(buffer), len, cache->topic,
+				  cache->value);
+	}
+
+	if (len == 1)
+		return;
+	buffer[len++] = '}';
+
+	snprintf(mqtt_topic, sizeof(mqtt_topic), "%s" S_FHT "%02u%02u/%s",
+		 mqtt_config.prefix, hauscode.upper, hauscode.lower, name);
+	publish_raw(mosquitto, mqtt_topic, buffer, len, MQTT_QOS_STATUS, retain);
+}
+
+/* publishes everything we know about a device as one retained object */
+static void mqtt_fht_snapshot(struct mosquitto *mosquitto,
+			      struct fht_device *device)
+{
+	mqtt_fht_object(mosquitto, device, "snapshot", false, true);
+}
+
+/* publishes all values reported since the last state object */
+static void mqtt_fht_state(struct mosquitto *mosquitto,
+			   struct fht_device *device)
+{
+	mqtt_fht_object(mosquitto, device, "state", true, mqtt_config.retain);
+}
+
+/* the FHZ frames transmissions of an FHT, collect them in one state object */
+static bool mqtt_fht_burst(struct mosquitto *mosquitto,
+			   struct fht_device *device, unsigned char function_id)
+{
+	switch (function_id) {
+	case FHT_START_XMIT:
+		if (device->burst)
+			mqtt_fht_state(mosquitto, device);
+		device->burst = loop_now();
+		return true;
+	case FHT_END_XMIT:
+		device->burst = 0;
+		mqtt_fht_state(mosquitto, device);
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* flushes bursts whose end we missed */
+static void mqtt_fht_bursts_expire(struct mosquitto *mosquitto)
+{
+	struct fht_device *device;
+	uint64_t now = loop_now();
+
+	for_each_fht_device(device)
+		if (device->burst && now - device->burst > MQTT_BURST_TIMEOUT) {
+			device->burst = 0;
+			mqtt_fht_state(mosquitto, device);
+		}
 }
 
 static int mqtt_publish_fht(struct mosquitto *mosquitto,
 			    const struct fht_message *message)
 {
-	const char *type;
+	struct fht_device *device = NULL;
+	struct fht_topic_cache *cache;
+	bool changed, snapshot = false, state = false;
+	char mqtt_topic[MQTT_TOPIC_MAX], value[16], *topic;
+	unsigned int n;
+	int len;
+
+	/* the prefix is shared by all reports of the message */
+	len = snprintf(mqtt_topic, sizeof(mqtt_topic),
+		       "%s" S_FHT "%02u%02u/%s/", mqtt_config.prefix,
+		       message->hauscode.upper, message->hauscode.lower,
+		       message->type == ACK ? "ack" : "status");
+	topic = mqtt_topic + len;
+
+	/* a persistent table keeps the values for the next start */
+	if (message->type == STATUS &&
+	    (mqtt_config.changes_only || mqtt_config.snapshot ||
+	     mqtt_config.json || fht_devices_persistent()))
+		device = fht_device_find(&message->hauscode);
+
+	if (device && mqtt_config.json &&
+	    mqtt_fht_burst(mosquitto, device, message->function_id))
+		return 0;
+
+	for (n = 0; n < message->reports; n++) {
+		len = fht_format_report(message, n, topic,
+					sizeof(mqtt_topic) - (topic - mqtt_topic),
+					value, sizeof(value));
+		if (len < 0 || !topic[0])
+			continue;
+
+		cache = device ? mqtt_fht_topic(device, topic) : NULL;
+		if (cache) {
+			changed = mqtt_fht_changed(cache, value);
+			snapshot |= changed;
+			if (!changed && mqtt_config.changes_only)
+				continue;
+			if (mqtt_config.json) {
+				cache->dirty = true;
+				state = true;
+				continue;
+			}
+		}
+
+		publish_raw(mosquitto, mqtt_topic, value, len,
+			    message->type == ACK ? MQTT_QOS_ACK : MQTT_QOS_STATUS,
+			    message->type == STATUS && mqtt_config.retain);
+	}
+
+	if (state && !device->burst)
+		mqtt_fht_state(mosquitto, device);
+
+	if (snapshot && mqtt_config.snapshot)
+		mqtt_fht_snapshot(mosquitto, device);
+
+	return 0;
+}
+
+/* publishes the last known values of all devices, like they were reported */
+static void mqtt_fht_restore(struct mosquitto *mosquitto)
+{
+	char mqtt_topic[MQTT_TOPIC_MAX];
+	struct fht_topic_cache *cache;
+	struct fht_device *device;
+	struct hauscode hauscode;
+	unsigned int devices = 0;
 	int i;
 
-	type = message->type == ACK ? "ack" : "status";
+	for_each_fht_device(device) {
+		if (!device->topics[0].published)
+			continue;
+		devices++;
 
-	for (i = 0; i < ARRAY_SIZE(message->report); i++) {
-		if (!message->report[i].topic[0])
+		if (mqtt_config.snapshot)
+			mqtt_fht_snapshot(mosquitto, device);
+		if (mqtt_config.json) {
+			mqtt_fht_object(mosquitto, device, "state", false,
+					mqtt_config.retain);
 			continue;
-		publish(mosquitto, type, &message->hauscode,
-			message->report[i].topic, message->report[i].value);
+		}
+
+		hauscode = fht_device_hauscode(device);
+		for (i = 0; i < ARRAY_SIZE(device->topics); i++) {
+			cache = &device->topics[i];
+			if (!cache->topic[0])
+				break;
+			if (!cache->published)
+				continue;
+			snprintf(mqtt_topic, sizeof(mqtt_topic),
+				 "%s" S_FHT "%02u%02u/status/%s",
+				 mqtt_config.prefix, hauscode.upper,
+				 hauscode.lower, cache->topic);
+			publish_raw(mosquitto, mqtt_topic, cache->value,
+				    strlen(cache->value), MQTT_QOS_STATUS,
+				    mqtt_config.retain);
+		}
+	}
+
+	info("MQTT: published the state of %u known FHTs\n", devices);
+}
+
+int mqtt_publish_ack_id(struct mosquitto *mosquitto,
+			const struct fht_message *message, const char *id)
+{
+	char mqtt_topic[MQTT_TOPIC_MAX], value[16], *topic;
+	int len;
+
+	len = snprintf(mqtt_topic, sizeof(mqtt_topic),
+		       "%s" S_FHT "%02u%02u/ack/", mqtt_config.prefix,
+		       message->hauscode.upper, message->hauscode.lower);
+	topic = mqtt_topic + len;
+
+	len = fht_format_report(message, 0, topic,
+				sizeof(mqtt_topic) - (topic - mqtt_topic),
+				value, sizeof(value));
+	if (len < 0)
+		return len;
+
+	topic += strlen(topic);
+	if (snprintf(topic, sizeof(mqtt_topic) - (topic - mqtt_topic), "/%s",
+		     id) >= sizeof(mqtt_topic) - (topic - mqtt_topic))
+		return -ENOSPC;
+
+	publish_raw(mosquitto, mqtt_topic, value, len, MQTT_QOS_ACK, false);
+
+	return 0;
+}
+
+int mqtt_parse_qos(const char *arg)
+{
+	unsigned char qos[MQTT_QOS_CLASSES];
+	unsigned int i;
+
+	memcpy(qos, mqtt_config.qos, sizeof(qos));
+	for (i = 0; i < ARRAY_SIZE(qos); i++) {
+		if (*arg < '0' || *arg > '2')
+			return -EINVAL;
+		qos[i] = *arg++ - '0';
+		if (!*arg)
+			break;
+		if (*arg++ != ',')
+			return -EINVAL;
+	}
+	if (*arg)
+		return -EINVAL;
+
+	memcpy(mqtt_config.qos, qos, sizeof(qos));
+	return 0;
+}
+
+static void mqtt_spool_push(const struct fhz_message *message)
+{
+	if (mqtt_spool.count == mqtt_config.spool) {
+		mqtt_spool.first = (mqtt_spool.first + 1) % mqtt_config.spool;
+		mqtt_spool.count--;
+		metric_inc(METRIC_SPOOL_DROPPED);
+	}
+
+	mqtt_spool.ring[(mqtt_spool.first + mqtt_spool.count++) %
+			mqtt_config.spool] = *message;
+	metric_inc(METRIC_SPOOLED);
+}
+
+static void mqtt_spool_flush(struct mosquitto *mosquitto)
+{
+	struct fhz_message message;
+
+	if (mqtt_spool.count)
+		info("MQTT: publishing %u spooled messages\n",
+		     mqtt_spool.count);
+
+	while (mqtt_spool.count && mqtt_connected) {
+		message = mqtt_spool.ring[mqtt_spool.first];
+		mqtt_spool.first = (mqtt_spool.first + 1) % mqtt_config.spool;
+		mqtt_spool.count--;
+
+		if (!mqtt_publish(mosquitto, &message))
+			metric_observe(METRIC_RX_PUBLISH_LATENCY,
+				       metrics_now() - message.received);
+	}
+}
+
+/* the spool file is the magic, the size of a message and the messages */
+static void mqtt_spool_load(const char *path)
+{
+	char magic[MQTT_SPOOL_MAGIC_LEN];
+	struct fhz_message message;
+	uint32_t size;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		if (errno != ENOENT)
+			warning("spool %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	if (fread(magic, sizeof(magic), 1, f) != 1 ||
+	    memcmp(magic, MQTT_SPOOL_MAGIC, sizeof(magic)) ||
+	    fread(&size, sizeof(size), 1, f) != 1 || size != sizeof(message)) {
+		warning("spool %s: invalid or incompatible file\n", path);
+		goto close_out;
+	}
+
+	while (fread(&message, sizeof(message), 1, f) == 1) {
+		if (message.machine == FHZ_NONE ||
+		    message.machine >= FHZ_MACHINES)
+			continue;
+		/* CLOCK_MONOTONIC doesn't survive a restart */
+		message.received = metrics_now();
+		mqtt_spool_push(&message);
+	}
+	info("spool %s: loaded %u messages\n", path, mqtt_spool.count);
+
+	/* they are written back on exit if they can't be published */
+	unlink(path);
+
+close_out:
+	fclose(f);
+}
+
+static void mqtt_spool_save(const char *path)
+{
+	uint32_t size = sizeof(*mqtt_spool.ring);
+	unsigned int i;
+	FILE *f;
+
+	if (!mqtt_spool.count)
+		return;
+
+	f = fopen(path, "w");
+	if (!f) {
+		error("spool %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	fwrite(MQTT_SPOOL_MAGIC, MQTT_SPOOL_MAGIC_LEN, 1, f);
+	fwrite(&size, sizeof(size), 1, f);
+	for (i = 0; i < mqtt_spool.count; i++)
+		fwrite(&mqtt_spool.ring[(mqtt_spool.first + i) %
+					mqtt_config.spool],
+		       size, 1, f);
+
+	if (fclose(f))
+		error("spool %s: %s\n", path, strerror(errno));
+	else
+		info("spool %s: saved %u messages\n", path, mqtt_spool.count);
+}
+
+#define MQTT_PROGRAM_FAILED "{\"error\":\"timeout\"}"
+
+int mqtt_publish_program(struct mosquitto *mosquitto,
+			 const struct hauscode *hauscode, const char *id,
+			 bool failed)
+{
+	char mqtt_topic[MQTT_TOPIC_MAX], value[FHT_PROGRAM_JSON_LEN];
+	struct fht_device *device;
+	int len;
+
+	if (failed) {
+		len = sizeof(MQTT_PROGRAM_FAILED) - 1;
+		memcpy(value, MQTT_PROGRAM_FAILED, len + 1);
+	} else {
+		device = fht_device_find(hauscode);
+		if (!device)
+			return -ENOENT;
+
+		len = fht_format_program(device, value, sizeof(value));
+		if (len < 0)
+			return len;
+	}
+
+	if (snprintf(mqtt_topic, sizeof(mqtt_topic),
+		     "%s" S_FHT "%02u%02u/ack/program%s%s", mqtt_config.prefix,
+		     hauscode->upper, hauscode->lower, id && *id ? "/" : "",
+		     id ? id : "") >=
+	    sizeof(mqtt_topic))
+		return -ENOSPC;
+
+	publish_raw(mosquitto, mqtt_topic, value, len, MQTT_QOS_ACK, false);
+
+	return 0;
+}
+
+static int mqtt_publish_fs20(struct mosquitto *mosquitto,
+			     const struct fs20_message *message)
+{
+	char mqtt_topic[MQTT_TOPIC_MAX], value[24], *topic;
+	unsigned int n;
+	int len;
+
+	len = snprintf(mqtt_topic, sizeof(mqtt_topic), "%s" S_FS20 "%02x%02x/",
+		       mqtt_config.prefix, message->hauscode[0],
+		       message->hauscode[1]);
+	topic = mqtt_topic + len;
+
+	for (n = 0; n < message->reports; n++) {
+		len = fs20_format_report(message, n, topic,
+					 sizeof(mqtt_topic) -
+					 (topic - mqtt_topic),
+					 value, sizeof(value));
+		if (len < 0)
+			continue;
+		publish_raw(mosquitto, mqtt_topic, value, len,
+			    MQTT_QOS_STATUS, mqtt_config.retain);
 	}
 
 	return 0;
@@ -115,27 +723,30 @@ static int mqtt_publish_fht(struct mosquitto *mosquitto,
 
 int mqtt_publish(struct mosquitto *mosquitto, const struct fhz_message *message)
 {
+	if (!mqtt_connected && mqtt_spool.ring) {
+		mqtt_spool_push(message);
+		return -EAGAIN;
+	}
+
 	switch (message->machine) {
 	case FHT:
 		return mqtt_publish_fht(mosquitto, &message->fht);
+	case FS20:
+		return mqtt_publish_fs20(mosquitto, &message->fs20);
 	default:
 		return -EINVAL;
 	}
 }
 
-int mqtt_handle(struct mosquitto *mosquitto)
+static int mqtt_error(int err)
 {
-	int err;
-
-	err = mosquitto_loop(mosquitto, 0, 1);
-	if (err == MOSQ_ERR_CONN_LOST || err == MOSQ_ERR_NO_CONN) {
-		err = mosquitto_reconnect(mosquitto);
-		if (!err)
-			err = mqtt_subscribe(mosquitto);
-	}
 	switch (err) {
 	case MOSQ_ERR_SUCCESS:
-		break;
+		return 0;
+	case MOSQ_ERR_NOMEM:
+		return -ENOMEM;
+	case MOSQ_ERR_NOT_SUPPORTED:
+		return -EOPNOTSUPP;
 	case MOSQ_ERR_CONN_LOST:
 		return -ECONNABORTED;
 	case MOSQ_ERR_NO_CONN:
@@ -145,56 +756,242 @@ int mqtt_handle(struct mosquitto *mosquitto)
 	default:
 		return -EINVAL;
 	}
+}
 
-	return 0;
+int mqtt_publish_sys(struct mosquitto *mosquitto, const char *topic,
+		     unsigned long value)
+{
+	char mqtt_topic[MQTT_TOPIC_MAX], mqtt_value[24];
+	int len;
+
+	snprintf(mqtt_topic, sizeof(mqtt_topic), "%s" S_SYS "%s",
+		 mqtt_config.prefix, topic);
+	len = snprintf(mqtt_value, sizeof(mqtt_value), "%lu", value);
+
+	return mqtt_error(mosquitto_publish(mosquitto, NULL, mqtt_topic, len,
+					    mqtt_value, 0, false));
+}
+
+/* schedules the next connection attempt, unless one is already pending */
+static void mqtt_retry(void)
+{
+	if (mqtt_retry_timer.armed)
+		return;
+
+	if (!mqtt_backoff)
+		mqtt_backoff = MQTT_BACKOFF_MIN;
+	else if (mqtt_backoff < MQTT_BACKOFF_MAX / 2)
+		mqtt_backoff *= 2;
+	else
+		mqtt_backoff = MQTT_BACKOFF_MAX;
+
+	debug("MQTT: reconnecting in %u ms\n", mqtt_backoff);
+	loop_timer_add(&mqtt_retry_timer, mqtt_backoff);
+}
+
+static void mqtt_handle(int err)
+{
+	if (err == MOSQ_ERR_SUCCESS)
+		return;
+
+	/* libmosquitto closes the socket on every error that is fatal */
+	if (mosquitto_socket(mqtt_mosquitto) == -1) {
+		mqtt_connected = false;
+		mqtt_retry();
+		return;
+	}
+
+	err = mqtt_error(err);
+	if (err)
+		error("MQTT error: %s\n", strerror(-err));
+}
+
+/*
+ * Connecting never blocks the loop: the socket connects in the background
+ * and the CONNACK arrives like any other packet.
+ */
+static void mqtt_reconnect(struct loop_timer *timer)
+{
+	metric_inc(METRIC_MQTT_RECONNECTS);
+	mqtt_handle(mosquitto_reconnect_async(mqtt_mosquitto));
+}
+
+static void mqtt_on_connect(struct mosquitto *mosquitto, void *userdata,
+			    int rc)
+{
+	if (rc) {
+		/* the broker closes the connection, mqtt_handle() retries */
+		warning("MQTT: connection refused (%d)\n", rc);
+		return;
+	}
+
+	info("MQTT: connected\n");
+	mqtt_connected = true;
+	mqtt_backoff = 0;
+
+	if (mqtt_subscribe(mosquitto))
+		error("mosquitto subscription error\n");
+
+	/* the spooled messages are newer than the table */
+	if (!mqtt_restored && fht_devices_persistent())
+		mqtt_fht_restore(mosquitto);
+	mqtt_restored = true;
+
+	mqtt_spool_flush(mosquitto);
+}
+
+static void mqtt_on_disconnect(struct mosquitto *mosquitto, void *userdata,
+			       int rc)
+{
+	if (mqtt_connected && rc)
+		warning("MQTT: connection lost\n");
+	mqtt_connected = false;
+}
+
+static void mqtt_prepare(struct loop_fd *watch)
+{
+	watch->fd = mosquitto_socket(mqtt_mosquitto);
+	watch->events = POLLIN;
+	if (mosquitto_want_write(mqtt_mosquitto))
+		watch->events |= POLLOUT;
+}
+
+static void mqtt_ready(struct loop_fd *watch, short revents)
+{
+	int err = MOSQ_ERR_SUCCESS;
+
+	if (revents & (POLLIN | POLLERR | POLLHUP))
+		err = mosquitto_loop_read(mqtt_mosquitto, 1);
+	if (!err && revents & POLLOUT)
+		err = mosquitto_loop_write(mqtt_mosquitto, 1);
+
+	mqtt_handle(err);
+}
+
+static void mqtt_misc(struct loop_timer *timer)
+{
+	mqtt_handle(mosquitto_loop_misc(mqtt_mosquitto));
+	if (mqtt_config.json)
+		mqtt_fht_bursts_expire(mqtt_mosquitto);
+	loop_timer_add(timer, MQTT_MISC_INTERVAL);
 }
 
-int mqtt_init(struct mosquitto **handle, int fd, const char *host, int port,
+int mqtt_init(struct mosquitto **handle, const char *host, int port,
 	      const char *username, const char *password)
 {
 	struct mosquitto *mosquitto;
+	size_t len;
 	int err;
 
 	if (!host || !port)
 		return -EINVAL;
 
-	if (mosquitto_lib_init() != MOSQ_ERR_SUCCESS)
+	len = strlen(mqtt_config.prefix);
+	if (!len || len >= MQTT_PREFIX_MAX ||
+	    mqtt_config.prefix[len - 1] != '/' ||
+	    strpbrk(mqtt_config.prefix, "+#")) {
+		error("MQTT: invalid topic prefix %s\n", mqtt_config.prefix);
 		return -EINVAL;
+	}
 
-	mosquitto = mosquitto_new(NULL, true, (void*)(size_t)fd);
-	if (!mosquitto)
-		return -errno;
+	/*
+	 * MQTT v5 sessions end with the connection, unless CONNECT carries an
+	 * expiry. libmosquitto only sends properties on its blocking connect.
+	 */
+	if (mqtt_config.persistent && mqtt_config.v5) {
+		error("MQTT: persistent sessions require MQTT 3.1.1\n");
+		return -EINVAL;
+	}
+
+	if (mqtt_config.persistent && !mqtt_config.client_id) {
+		error("MQTT: a persistent session requires a client id\n");
+		return -EINVAL;
+	}
+
+	err = mqtt_error(mosquitto_lib_init());
+	if (err)
+		return err;
+
+	mosquitto = mosquitto_new(mqtt_config.client_id,
+				  !mqtt_config.persistent, NULL);
+	if (!mosquitto) {
+		err = -errno;
+		goto cleanup_out;
+	}
+
+	err = mqtt_error(mosquitto_max_inflight_messages_set(mosquitto,
+						mqtt_config.max_inflight));
+	if (err)
+		goto close_out;
+
+	if (mqtt_config.v5) {
+		err = mqtt_error(mosquitto_int_option(mosquitto,
+						      MOSQ_OPT_PROTOCOL_VERSION,
+						      MQTT_PROTOCOL_V5));
+		if (err)
+			goto close_out;
+	}
 
 	if (username && password) {
-		err = mosquitto_username_pw_set(mosquitto, username, password);
+		err = mqtt_error(mosquitto_username_pw_set(mosquitto, username,
+							   password));
 		if (err)
 			goto close_out;
 	}
 
-	err = mosquitto_connect(mosquitto, host, port, 120);
-	if (err) {
-		fprintf(stderr, "mosquitto connect error\n");
-		goto close_out;
+	if (mqtt_config.spool) {
+		mqtt_spool.ring = calloc(mqtt_config.spool,
+					 sizeof(*mqtt_spool.ring));
+		if (!mqtt_spool.ring) {
+			err = -ENOMEM;
+			goto close_out;
+		}
+		if (mqtt_config.spool_file)
+			mqtt_spool_load(mqtt_config.spool_file);
 	}
 
-	err = mqtt_subscribe(mosquitto);
+	/* also called for MQTT 3.1.1, without properties */
+	mosquitto_message_v5_callback_set(mosquitto, callback);
+	mosquitto_connect_callback_set(mosquitto, mqtt_on_connect);
+	mosquitto_disconnect_callback_set(mosquitto, mqtt_on_disconnect);
+
+	mqtt_mosquitto = mosquitto;
+	mqtt_watch.prepare = mqtt_prepare;
+	mqtt_watch.handler = mqtt_ready;
+	loop_fd_add(&mqtt_watch);
+	mqtt_timer.handler = mqtt_misc;
+	loop_timer_add(&mqtt_timer, MQTT_MISC_INTERVAL);
+	mqtt_retry_timer.handler = mqtt_reconnect;
+
+	/* a broker that is down at startup is retried like a lost one */
+	err = mosquitto_connect_async(mosquitto, host, port,
+				      mqtt_config.keepalive);
 	if (err) {
-		fprintf(stderr, "mosquitto subscription error\n");
+		warning("MQTT: unable to connect to %s:%d: %s\n", host, port,
+			mosquitto_strerror(err));
+		mqtt_retry();
 	}
 
-	mosquitto_message_callback_set(mosquitto, callback);
-
 	*handle = mosquitto;
 	return 0;
 
 close_out:
 	mosquitto_destroy(mosquitto);
+cleanup_out:
 	mosquitto_lib_cleanup();
-	return -1;
+	return err;
 }
 
 void mqtt_close(struct mosquitto *mosquitto)
 {
+	if (mqtt_config.spool_file)
+		mqtt_spool_save(mqtt_config.spool_file);
+	free(mqtt_spool.ring);
+	mqtt_spool.ring = NULL;
+
+	loop_timer_del(&mqtt_retry_timer);
+	loop_timer_del(&mqtt_timer);
+	loop_fd_del(&mqtt_watch);
 	mosquitto_destroy(mosquitto);
 	mosquitto_lib_cleanup();
 }
@@ -10,13 +10,79 @@
  * the COPYING file in the top-level directory.
  */
 
+#include <stdbool.h>
+
 struct fhz_message;
+struct fht_message;
+struct hauscode;
 struct mosquitto;
 
-int mqtt_init(struct mosquitto **handle, int fd, const char *host, int port,
+/* classes of topics that have a QoS of their own */
+enum mqtt_qos_class {
+	MQTT_QOS_STATUS, /* status reports, snapshots and state objects */
+	MQTT_QOS_ACK, /* acks of commands */
+	MQTT_QOS_SET, /* the subscription to commands */
+	MQTT_QOS_CLASSES,
+};
+
+/* including the terminating zero */
+#define MQTT_PREFIX_MAX 32
+
+struct mqtt_config {
+	/* all topics are below it, must end with a '/' */
+	const char *prefix;
+	/* suppress status reports that didn't change since the last one */
+	bool changes_only;
+	/* seconds after which unchanged values are published anyway, 0: never */
+	unsigned int max_age;
+	/* publish status topics retained */
+	bool retain;
+	/* publish the known state of a device as retained JSON object */
+	bool snapshot;
+	/* publish status reports of a device as JSON objects, one per burst */
+	bool json;
+	/* messages kept while the broker is unreachable, 0: none */
+	unsigned int spool;
+	/* keeps the spooled messages across restarts, if set */
+	const char *spool_file;
+	/* a random one is picked by the broker if NULL */
+	const char *client_id;
+	/*
+	 * the broker keeps the subscription and QoS > 0 commands while we are
+	 * away, requires a client id
+	 */
+	bool persistent;
+	unsigned char qos[MQTT_QOS_CLASSES];
+	/* seconds */
+	unsigned int keepalive;
+	/* QoS > 0 messages in flight at once, 0: unlimited */
+	unsigned int max_inflight;
+	/* speak MQTT v5, so commands may carry a priority property */
+	bool v5;
+};
+
+extern struct mqtt_config mqtt_config;
+
+/* parses "status[,ack[,set]]" QoS levels into mqtt_config */
+int mqtt_parse_qos(const char *arg);
+
+int mqtt_init(struct mosquitto **handle, const char *host, int port,
 	      const char *username, const char *password);
 
 void mqtt_close(struct mosquitto *mosquitto);
-int mqtt_handle(struct mosquitto *mosquitto);
+/* returns -EAGAIN if the message was spooled until the broker is back */
 int mqtt_publish(struct mosquitto *mosquitto,
 		 const struct fhz_message *message);
+/* republishes an ack below its correlation id */
+int mqtt_publish_ack_id(struct mosquitto *mosquitto,
+			const struct fht_message *message, const char *id);
+/*
+ * publishes the weekly program of an FHT once all writes of an upload are
+ * acknowledged, id is the correlation id of the upload, if any. If a write
+ * was given up, {"error":"timeout"} is published instead.
+ */
+int mqtt_publish_program(struct mosquitto *mosquitto,
+			 const struct hauscode *hauscode, const char *id,
+			 bool failed);
+int mqtt_publish_sys(struct mosquitto *mosquitto, const char *topic,
+		     unsigned long value);
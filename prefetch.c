@@ -0,0 +1,134 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+
+#include "fhz.h"
+#include "loop.h"
+#include "prefetch.h"
+#include "txq.h"
+
+/*
+ * After a restart, nothing is known about the FHTs until they happen to
+ * transmit. An FHT transmits all its registers when it receives report1 and
+ * report2, the requests are acknowledged and the reports published like any
+ * other.
+ *
+ * The sweep doesn't flood the transmit queues. The requests of the next FHT
+ * are only queued once the queue of its FHZ has drained below the window,
+ * and at most every PREFETCH_INTERVAL. The queue sends both requests in one
+ * frame, with idle priority, so commands from MQTT go first.
+ */
+static struct hauscode prefetch_hauscodes[FHT_DEVICES_MAX];
+static unsigned int prefetch_count, prefetch_next;
+static struct loop_timer prefetch_timer;
+
+/* registers that make up the state we are after */
+static const unsigned char prefetch_registers[] = {
+	FHT_MODE,
+	FHT_DESIRED_TEMP,
+	FHT_DAY_TEMP,
+	FHT_NIGHT_TEMP,
+};
+
+static bool prefetch_known(const struct hauscode *hauscode)
+{
+	const struct fht_device *device;
+	unsigned int i;
+
+	device = fht_device_find(hauscode);
+	if (!device)
+		return false;
+
+	for (i = 0; i < ARRAY_SIZE(prefetch_registers); i++)
+		if (!fht_device_valid(device, prefetch_registers[i]))
+			return false;
+
+	return true;
+}
+
+static int prefetch_request(const struct hauscode *hauscode)
+{
+	return fht_set(hauscode, FHT_REPORT1, "", NULL, TXQ_PRIO_IDLE) ? :
+	       fht_set(hauscode, FHT_REPORT2, "", NULL, TXQ_PRIO_IDLE);
+}
+
+static void prefetch_run(struct loop_timer *timer)
+{
+	const struct hauscode *hauscode;
+	struct fhz *fhz;
+	int err;
+
+	for (; prefetch_next < prefetch_count; prefetch_next++) {
+		hauscode = &prefetch_hauscodes[prefetch_next];
+		/* it transmitted in the meantime */
+		if (prefetch_known(hauscode))
+			continue;
+
+		fhz = fhz_route(hauscode);
+		if (fhz && fhz->txq &&
+		    txq_depth(fhz->txq) >= txq_config.window)
+			break;
+
+		err = prefetch_request(hauscode);
+		if (err)
+			warning("fht %02u%02u: prefetch failed: %s\n",
+				hauscode->upper, hauscode->lower,
+				strerror(-err));
+		prefetch_next++;
+		break;
+	}
+
+	if (prefetch_next < prefetch_count) {
+		loop_timer_add(timer, PREFETCH_INTERVAL);
+		return;
+	}
+
+	info("prefetch: requested reports of %u FHTs\n", prefetch_count);
+}
+
+int prefetch_start(const char *hauscodes)
+{
+	unsigned int count = 0;
+	char buffer[5];
+	size_t len;
+
+	while (*hauscodes) {
+		len = strcspn(hauscodes, ",");
+		if (len != 4 || count == ARRAY_SIZE(prefetch_hauscodes))
+			return -EINVAL;
+
+		memcpy(buffer, hauscodes, 4);
+		buffer[4] = 0;
+		if (hauscode_from_string(buffer, &prefetch_hauscodes[count]))
+			return -EINVAL;
+		count++;
+
+		hauscodes += len;
+		if (*hauscodes == ',')
+			hauscodes++;
+	}
+
+	prefetch_count = count;
+	prefetch_next = 0;
+
+	prefetch_timer.handler = prefetch_run;
+	loop_timer_add(&prefetch_timer, 0);
+
+	return 0;
+}
+
+void prefetch_stop(void)
+{
+	loop_timer_del(&prefetch_timer);
+}
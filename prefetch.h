@@ -0,0 +1,21 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+/* ms between the requests of two FHTs */
+#define PREFETCH_INTERVAL 2000
+
+/*
+ * Requests full reports from a comma separated list of hauscodes, one FHT
+ * after the other, so that their state is known without waiting for them.
+ */
+int prefetch_start(const char *hauscodes);
+void prefetch_stop(void);
@@ -0,0 +1,275 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fhz.h"
+#include "record.h"
+
+/*
+ * Records are collected in one of two buffers, so the serial path only pays
+ * for a memcpy. A writer thread writes the other buffer, once it ran full
+ * or every RECORD_FLUSH_INTERVAL, so a slow disk never stalls the main loop
+ * or the receive threads. If both buffers are full, records are dropped.
+ */
+#define RECORD_BUFFER_SIZE (64 * 1024)
+#define RECORD_FLUSH_INTERVAL 1 /* s */
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool running;
+	bool stop;
+	atomic_int fd;
+	unsigned int active; /* the buffer records are appended to */
+	unsigned int used; /* of the active buffer */
+	unsigned int pending; /* of the other one, owned by the writer */
+	unsigned int dropped;
+	unsigned char buffer[2][RECORD_BUFFER_SIZE];
+} record = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+};
+
+static uint64_t record_clock(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int record_write(int fd, const void *buffer, size_t len)
+{
+	const unsigned char *data = buffer;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, data, len);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		data += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* called with the lock held, hands the active buffer to the writer */
+static void record_swap(void)
+{
+	record.pending = record.used;
+	record.active ^= 1;
+	record.used = 0;
+	pthread_cond_signal(&record.cond);
+}
+
+/* stops recording on errors */
+static void *record_thread(void *arg)
+{
+	const unsigned char *data;
+	unsigned int len, dropped;
+	struct timespec deadline;
+	int err, fd;
+
+	pthread_mutex_lock(&record.lock);
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += RECORD_FLUSH_INTERVAL;
+		while (!record.pending && !record.stop &&
+		       pthread_cond_timedwait(&record.cond, &record.lock,
+					      &deadline) != ETIMEDOUT)
+			;
+
+		if (!record.pending)
+			record_swap();
+		if (!record.pending) {
+			if (record.stop)
+				break;
+			continue;
+		}
+
+		data = record.buffer[record.active ^ 1];
+		len = record.pending;
+		dropped = record.dropped;
+		record.dropped = 0;
+		pthread_mutex_unlock(&record.lock);
+
+		if (dropped)
+			warning("recording: %u records dropped\n", dropped);
+
+		fd = atomic_load(&record.fd);
+		if (fd >= 0) {
+			err = record_write(fd, data, len);
+			if (err) {
+				error("recording: %s, stopped\n",
+				      strerror(-err));
+				fd = atomic_exchange(&record.fd, -1);
+				if (fd >= 0)
+					close(fd);
+			}
+		}
+
+		pthread_mutex_lock(&record.lock);
+		record.pending = 0;
+	}
+	pthread_mutex_unlock(&record.lock);
+
+	return NULL;
+}
+
+static void record_append(enum record_type type, unsigned int port,
+			  unsigned char tt, const void *data, unsigned int len)
+{
+	struct record_header header = {
+		.len = len,
+		.type = type,
+		.tt = tt,
+		.port = port,
+		.timestamp = record_clock(CLOCK_MONOTONIC),
+	};
+	unsigned char *buffer;
+
+	pthread_mutex_lock(&record.lock);
+	/* recording may have stopped since the caller checked */
+	if (atomic_load(&record.fd) < 0)
+		goto unlock_out;
+
+	if (record.used + sizeof(header) + len > RECORD_BUFFER_SIZE) {
+		/* the writer is still busy with the other buffer */
+		if (record.pending) {
+			record.dropped++;
+			goto unlock_out;
+		}
+		record_swap();
+	}
+
+	buffer = record.buffer[record.active] + record.used;
+	memcpy(buffer, &header, sizeof(header));
+	memcpy(buffer + sizeof(header), data, len);
+	record.used += sizeof(header) + len;
+
+unlock_out:
+	pthread_mutex_unlock(&record.lock);
+}
+
+void record_frame(enum record_type type, unsigned int port, unsigned char tt,
+		  const unsigned char *data, unsigned int len)
+{
+	if (atomic_load_explicit(&record.fd, memory_order_relaxed) < 0)
+		return;
+
+	record_append(type, port, tt, data, len);
+}
+
+/* appending to anything else would corrupt it */
+static int record_check(int fd, const char *path)
+{
+	char magic[RECORD_MAGIC_LEN];
+	ssize_t len;
+
+	len = pread(fd, magic, sizeof(magic), 0);
+	if (len == -1)
+		return -errno;
+
+	if (len != sizeof(magic) || memcmp(magic, RECORD_MAGIC, sizeof(magic))) {
+		error("recording: %s is no recording, not appending\n", path);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int record_open(const char *path)
+{
+	pthread_condattr_t attr;
+	uint64_t realtime;
+	struct stat st;
+	int err, fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return -errno;
+
+	if (fstat(fd, &st)) {
+		err = -errno;
+		goto close_out;
+	}
+
+	if (st.st_size)
+		err = record_check(fd, path);
+	else
+		err = record_write(fd, RECORD_MAGIC, RECORD_MAGIC_LEN);
+	if (err)
+		goto close_out;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	err = -pthread_cond_init(&record.cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (err)
+		goto close_out;
+
+	atomic_store(&record.fd, fd);
+
+	realtime = record_clock(CLOCK_REALTIME);
+	record_append(RECORD_SYNC, 0, 0, &realtime, sizeof(realtime));
+
+	err = -pthread_create(&record.thread, NULL, record_thread, NULL);
+	if (err)
+		goto cond_out;
+	record.running = true;
+
+	return 0;
+
+cond_out:
+	atomic_store(&record.fd, -1);
+	record.used = 0;
+	pthread_cond_destroy(&record.cond);
+close_out:
+	close(fd);
+	return err;
+}
+
+void record_close(void)
+{
+	int fd;
+
+	if (!record.running)
+		return;
+
+	/* the writer flushes both buffers before it stops */
+	pthread_mutex_lock(&record.lock);
+	record.stop = true;
+	pthread_cond_signal(&record.cond);
+	pthread_mutex_unlock(&record.lock);
+
+	pthread_join(record.thread, NULL);
+	record.running = false;
+	pthread_cond_destroy(&record.cond);
+
+	fd = atomic_exchange(&record.fd, -1);
+	if (fd >= 0)
+		close(fd);
+}
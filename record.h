@@ -0,0 +1,48 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <stdint.h>
+
+/*
+ * Recording of raw FHZ frames. A recording starts with RECORD_MAGIC and is
+ * followed by records, each a struct record_header and len bytes of data,
+ * in host byte order and without padding. Data of RX and TX records is the
+ * payload of a valid frame, i.e., without magic, length and checksum.
+ *
+ * Every time a recording is opened, a SYNC record with the CLOCK_REALTIME
+ * in ns as data is appended, so monotonic timestamps can be mapped to the
+ * wall clock.
+ */
+#define RECORD_MAGIC "FHZREC1\n"
+#define RECORD_MAGIC_LEN 8
+
+enum record_type {
+	RECORD_RX,
+	RECORD_TX,
+	RECORD_SYNC,
+};
+
+struct record_header {
+	uint16_t len;
+	uint8_t type;
+	uint8_t tt;
+	uint8_t port; /* index of the FHZ */
+	uint8_t reserved[3];
+	uint64_t timestamp; /* CLOCK_MONOTONIC in ns */
+};
+
+int record_open(const char *path);
+void record_close(void);
+
+/* may be called from any thread, is a no-op if no recording is open */
+void record_frame(enum record_type type, unsigned int port, unsigned char tt,
+		  const unsigned char *data, unsigned int len);
@@ -0,0 +1,118 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "fhz.h"
+#include "rxq.h"
+
+int rxq_init(struct rxq *rxq, unsigned int size)
+{
+	if (!size || size & (size - 1))
+		return -EINVAL;
+
+	rxq->ring = calloc(size, sizeof(*rxq->ring));
+	if (!rxq->ring)
+		return -ENOMEM;
+
+	rxq->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (rxq->event_fd == -1) {
+		free(rxq->ring);
+		return -errno;
+	}
+
+	rxq->size = size;
+	atomic_init(&rxq->head, 0);
+	atomic_init(&rxq->tail, 0);
+	atomic_init(&rxq->overflow, 0);
+	atomic_init(&rxq->max_depth, 0);
+
+	return 0;
+}
+
+void rxq_destroy(struct rxq *rxq)
+{
+	close(rxq->event_fd);
+	free(rxq->ring);
+	rxq->ring = NULL;
+}
+
+bool rxq_push(struct rxq *rxq, const struct fhz_message *message)
+{
+	unsigned int head, tail, depth;
+	const uint64_t kick = 1;
+	ssize_t ret;
+
+	head = atomic_load_explicit(&rxq->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&rxq->tail, memory_order_acquire);
+
+	if (head - tail == rxq->size) {
+		atomic_store_explicit(&rxq->overflow,
+			atomic_load_explicit(&rxq->overflow,
+					     memory_order_relaxed) + 1,
+			memory_order_relaxed);
+		return false;
+	}
+
+	rxq->ring[head & (rxq->size - 1)] = *message;
+	atomic_store_explicit(&rxq->head, head + 1, memory_order_release);
+
+	depth = head + 1 - tail;
+	if (depth > atomic_load_explicit(&rxq->max_depth, memory_order_relaxed))
+		atomic_store_explicit(&rxq->max_depth, depth,
+				      memory_order_relaxed);
+
+	/*
+	 * Always kick, deciding on the emptiness of the queue here would race
+	 * with the consumer. Frames arrive at 9600 baud, that's cheap enough.
+	 */
+	ret = write(rxq->event_fd, &kick, sizeof(kick));
+	(void)ret; /* only fails if the consumer is awake anyway */
+
+	return true;
+}
+
+bool rxq_pop(struct rxq *rxq, struct fhz_message *message)
+{
+	unsigned int head, tail;
+
+	tail = atomic_load_explicit(&rxq->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&rxq->head, memory_order_acquire);
+
+	if (head == tail)
+		return false;
+
+	*message = rxq->ring[tail & (rxq->size - 1)];
+	atomic_store_explicit(&rxq->tail, tail + 1, memory_order_release);
+
+	return true;
+}
+
+/* consumer: reset the wakeup before draining the queue */
+void rxq_ack(struct rxq *rxq)
+{
+	uint64_t kicks;
+	ssize_t ret;
+
+	ret = read(rxq->event_fd, &kicks, sizeof(kicks));
+	(void)ret; /* spurious wakeup */
+}
+
+unsigned int rxq_depth(struct rxq *rxq)
+{
+	return atomic_load_explicit(&rxq->head, memory_order_relaxed) -
+	       atomic_load_explicit(&rxq->tail, memory_order_relaxed);
+}
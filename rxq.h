@@ -0,0 +1,45 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+struct fhz_message;
+
+/*
+ * Bounded, lock-free single-producer/single-consumer queue of decoded FHZ
+ * messages. The serial thread pushes, the MQTT thread pops. head is only
+ * written by the producer, tail only by the consumer.
+ */
+struct rxq {
+	struct fhz_message *ring;
+	unsigned int size; /* power of two */
+	int event_fd; /* kicked on every push */
+
+	_Alignas(64) atomic_uint head;
+	atomic_uint overflow;
+	atomic_uint max_depth;
+
+	_Alignas(64) atomic_uint tail;
+};
+
+int rxq_init(struct rxq *rxq, unsigned int size);
+void rxq_destroy(struct rxq *rxq);
+
+/* producer side */
+bool rxq_push(struct rxq *rxq, const struct fhz_message *message);
+
+/* consumer side */
+bool rxq_pop(struct rxq *rxq, struct fhz_message *message);
+void rxq_ack(struct rxq *rxq);
+
+unsigned int rxq_depth(struct rxq *rxq);
@@ -0,0 +1,397 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+/*
+ * Replays captured FHZ traffic through the receive path: frame reassembly,
+ * fht_decode() and MQTT topic formatting. Nothing is sent to a broker, build
+ * with -DNO_SEND.
+ *
+ * The capture is either a binary recording, see record.h, of which the
+ * received frames are replayed, or text, one frame per line as printed by
+ * the DEBUG hexdump, e.g. "81 0C 04 E7 09 09 A0 01 11 22 00 00 26 80".
+ * Everything from a '#' to the end of a line is ignored.
+ *
+ * With -b, the best frames/sec of all runs is compared against a baseline
+ * written by an earlier -w, and a drop of more than the tolerance fails.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../fhz.h"
+#include "../mqtt.h"
+#include "../record.h"
+
+static unsigned long allocations;
+
+/* linked with --wrap, counts allocations of the code under test */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t nmemb, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	allocations++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	allocations++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __real_realloc(ptr, size);
+}
+
+struct capture {
+	unsigned char *data;
+	size_t len;
+	size_t size;
+	unsigned int frames;
+};
+
+/* pipes are written in chunks, so frames get split like on a serial line */
+#define REPLAY_CHUNK 4096
+
+static int capture_put(struct capture *capture, unsigned char byte)
+{
+	void *tmp;
+
+	if (capture->len == capture->size) {
+		capture->size = capture->size ? capture->size * 2 : REPLAY_CHUNK;
+		tmp = realloc(capture->data, capture->size);
+		if (!tmp)
+			return -ENOMEM;
+		capture->data = tmp;
+	}
+	capture->data[capture->len++] = byte;
+
+	return 0;
+}
+
+/* rebuilds the received frames of a binary recording */
+static int load_recording(int fd, struct capture *capture)
+{
+	struct record_header header;
+	const unsigned char *map;
+	unsigned char bc;
+	struct stat st;
+	unsigned int i;
+	size_t off;
+	int err = 0;
+
+	if (fstat(fd, &st))
+		return -errno;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	for (off = RECORD_MAGIC_LEN; off + sizeof(header) <= st.st_size;
+	     off += sizeof(header) + header.len) {
+		memcpy(&header, map + off, sizeof(header));
+		/* the last record may be cut off */
+		if (off + sizeof(header) + header.len > st.st_size)
+			break;
+		if (header.type != RECORD_RX)
+			continue;
+		if (header.len > 0xff - 2) {
+			err = -EINVAL;
+			break;
+		}
+
+		bc = 0;
+		for (i = 0; i < header.len; i++)
+			bc += map[off + sizeof(header) + i];
+
+		err = capture_put(capture, FHZ_MAGIC) ? :
+		      capture_put(capture, header.len + 2) ? :
+		      capture_put(capture, header.tt) ? :
+		      capture_put(capture, bc);
+		for (i = 0; !err && i < header.len; i++)
+			err = capture_put(capture, map[off + sizeof(header) + i]);
+		if (err)
+			break;
+		capture->frames++;
+	}
+
+	munmap((void *)map, st.st_size);
+
+	if (err)
+		return err;
+	return capture->frames ? 0 : -ENODATA;
+}
+
+/* converts the text capture to raw bytes */
+static int load_capture(FILE *in, struct capture *capture)
+{
+	char line[1024], *pos, *end;
+	unsigned long byte;
+	unsigned int bytes;
+	int err;
+
+	while (fgets(line, sizeof(line), in)) {
+		pos = strchr(line, '#');
+		if (pos)
+			*pos = 0;
+
+		bytes = 0;
+		for (pos = line; ; pos = end) {
+			byte = strtoul(pos, &end, 16);
+			if (end == pos)
+				break;
+			if (byte > 0xff)
+				return -EINVAL;
+			err = capture_put(capture, byte);
+			if (err)
+				return err;
+			bytes++;
+		}
+		if (bytes)
+			capture->frames++;
+	}
+
+	if (ferror(in))
+		return -EIO;
+
+	return capture->frames ? 0 : -ENODATA;
+}
+
+/* writes the capture to the pipe and drains it through the receive path */
+static void replay(const struct capture *capture, struct fhz *fhz, int fd,
+		   unsigned long *decoded, unsigned long *skipped)
+{
+	struct fhz_message message;
+	size_t off, len;
+	ssize_t ret;
+	int err;
+
+	for (off = 0; off < capture->len; off += len) {
+		len = capture->len - off;
+		if (len > REPLAY_CHUNK)
+			len = REPLAY_CHUNK;
+		ret = write(fd, capture->data + off, len);
+		if (ret <= 0)
+			return;
+		len = ret;
+
+		while ((err = fhz_handle(fhz, &message)) != -EAGAIN) {
+			if (!err)
+				err = fhz_update(&message);
+			if (err) {
+				(*skipped)++;
+				continue;
+			}
+			(*decoded)++;
+			mqtt_publish(NULL, &message);
+		}
+	}
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the default tolerance of -b, in percent */
+#define REPLAY_TOLERANCE 10
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: fhz_replay [-n passes] [-r runs] [-c] [-j] "
+		"[-b baseline [-t percent]] [-w baseline] capture\n");
+}
+
+static int read_baseline(const char *path, double *rate)
+{
+	FILE *f;
+	int ret;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+	ret = fscanf(f, "frames/sec: %lf", rate);
+	fclose(f);
+
+	return ret == 1 ? 0 : -EINVAL;
+}
+
+static int write_baseline(const char *path, double rate)
+{
+	FILE *f;
+	int err;
+
+	f = fopen(path, "w");
+	if (!f)
+		return -errno;
+	fprintf(f, "frames/sec: %.0f\n", rate);
+	err = ferror(f) ? -EIO : 0;
+	if (fclose(f) && !err)
+		err = -errno;
+
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long passes = 1000, pass, decoded = 0, skipped = 0;
+	const char *baseline = NULL, *new_baseline = NULL;
+	unsigned int runs = 1, run, tolerance = REPLAY_TOLERANCE;
+	struct capture capture = {NULL, 0, 0, 0};
+	char magic[RECORD_MAGIC_LEN];
+	unsigned long allocations_start;
+	uint64_t start, ns, best = 0;
+	double rate, expected;
+	int c, fds[2], err;
+	struct fhz *fhz;
+	FILE *in;
+
+	while ((c = getopt(argc, argv, "hn:r:cjb:t:w:")) != -1) {
+		switch (c) {
+		case 'n':
+			passes = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			runs = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			baseline = optarg;
+			break;
+		case 't':
+			tolerance = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			new_baseline = optarg;
+			break;
+		case 'c':
+			mqtt_config.changes_only = true;
+			break;
+		case 'j':
+			mqtt_config.json = true;
+			break;
+		default:
+			usage();
+			return c == 'h' ? 0 : -EINVAL;
+		}
+	}
+
+	if (optind != argc - 1 || !passes || !runs || tolerance >= 100) {
+		usage();
+		return -EINVAL;
+	}
+
+	in = fopen(argv[optind], "r");
+	if (!in) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		return -errno;
+	}
+
+	if (fread(magic, sizeof(magic), 1, in) == 1 &&
+	    !memcmp(magic, RECORD_MAGIC, sizeof(magic))) {
+		err = load_recording(fileno(in), &capture);
+	} else {
+		rewind(in);
+		err = load_capture(in, &capture);
+	}
+	if (err) {
+		fprintf(stderr, "Invalid capture: %s\n", strerror(-err));
+		goto close_out;
+	}
+
+	if (pipe(fds)) {
+		err = -errno;
+		goto close_out;
+	}
+
+	/* like the fds of fhz_open() */
+	if (fcntl(fds[0], F_SETFL, O_NONBLOCK) == -1) {
+		err = -errno;
+		goto pipe_out;
+	}
+
+	fhz = fhz_add(fds[0]);
+	if (!fhz) {
+		err = -E2BIG;
+		goto pipe_out;
+	}
+
+	allocations_start = allocations;
+	for (run = 0; run < runs; run++) {
+		start = now_ns();
+		for (pass = 0; pass < passes; pass++)
+			replay(&capture, fhz, fds[1], &decoded, &skipped);
+		ns = now_ns() - start;
+		if (!best || ns < best)
+			best = ns;
+	}
+	rate = (double)capture.frames * passes * 1e9 / best;
+
+	printf("frames:      %lu (%lu decoded, %lu without report)\n",
+	       (unsigned long)capture.frames * passes * runs, decoded, skipped);
+	printf("frames/sec:  %.0f\n", rate);
+	printf("ns/frame:    %.1f\n", (double)best / capture.frames / passes);
+	printf("allocations: %lu\n", allocations - allocations_start);
+
+	if (baseline) {
+		err = read_baseline(baseline, &expected);
+		if (err) {
+			fprintf(stderr, "%s: %s\n", baseline, strerror(-err));
+			goto pipe_out;
+		}
+		printf("baseline:    %.0f (%+.1f%%)\n", expected,
+		       (rate / expected - 1) * 100);
+		if (rate < expected * (100 - tolerance) / 100) {
+			fprintf(stderr, "throughput regressed by more than "
+				"%u%%\n", tolerance);
+			err = -ERANGE;
+			goto pipe_out;
+		}
+		/* neither may the receive path start to allocate */
+		if (allocations != allocations_start) {
+			fprintf(stderr, "the receive path allocates\n");
+			err = -ENOMEM;
+			goto pipe_out;
+		}
+	}
+
+	if (new_baseline) {
+		err = write_baseline(new_baseline, rate);
+		if (err)
+			fprintf(stderr, "%s: %s\n", new_baseline,
+				strerror(-err));
+	}
+
+pipe_out:
+	close(fds[0]);
+	close(fds[1]);
+close_out:
+	free(capture.data);
+	fclose(in);
+	return err;
+}
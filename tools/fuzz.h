@@ -0,0 +1,26 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+/*
+ * The fuzz targets are plain libFuzzer entry points. Linked with
+ * tools/fuzz_main.c, they also run without libFuzzer: over files and
+ * directories given on the command line, which is how the corpus is
+ * replayed by "make fuzz-check", or over stdin, which is what AFL expects.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* inputs are cut to this size, longer ones don't reach new code */
+#define FUZZ_INPUT_MAX 4096
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
@@ -0,0 +1,61 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+/*
+ * Fuzzes the decoders on their own: the input is a frame as handed over by
+ * the reassembler, tt followed by the data. Both decoders see every frame,
+ * regardless of its magic, and every report is formatted.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../fhz.h"
+#include "fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	char topic[64], value[64];
+	struct fs20_message fs20;
+	struct fht_message fht;
+	struct fhz_frame frame;
+	unsigned char *copy;
+	unsigned int n;
+
+	if (!size || size - 1 > 0xff - 2)
+		return 0;
+	log_level = -1;
+
+	/* of the exact length, so sanitizers catch reads behind the frame */
+	copy = malloc(size - 1 ? : 1);
+	if (!copy)
+		abort();
+	memcpy(copy, data + 1, size - 1);
+	frame.tt = data[0];
+	frame.len = size - 1;
+	frame.port = 0;
+	frame.received = 0;
+	frame.data = copy;
+
+	if (!fht_decode(&frame, &fht) && !fht_update(&fht, frame.port))
+		for (n = 0; n < fht.reports; n++)
+			fht_format_report(&fht, n, topic, sizeof(topic), value,
+					  sizeof(value));
+
+	if (!fs20_decode(&frame, &fs20))
+		for (n = 0; n < fs20.reports; n++)
+			fs20_format_report(&fs20, n, topic, sizeof(topic),
+					   value, sizeof(value));
+
+	free(copy);
+	return 0;
+}
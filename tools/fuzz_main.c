@@ -0,0 +1,105 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+/*
+ * Runs a fuzz target without libFuzzer, see fuzz.h. Inputs are processed in
+ * the order given, directories in the order of their sorted entries, so
+ * runs are reproducible.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "fuzz.h"
+
+static unsigned long inputs;
+
+static int run_file(FILE *f)
+{
+	static uint8_t data[FUZZ_INPUT_MAX];
+	size_t size;
+
+	size = fread(data, 1, sizeof(data), f);
+	if (ferror(f))
+		return -EIO;
+
+	LLVMFuzzerTestOneInput(data, size);
+	inputs++;
+
+	return 0;
+}
+
+static int run_path(const char *path);
+
+static int run_dir(const char *path)
+{
+	struct dirent **entries;
+	char name[4096];
+	int i, n, err = 0;
+
+	n = scandir(path, &entries, NULL, alphasort);
+	if (n < 0)
+		return -errno;
+
+	for (i = 0; i < n; i++) {
+		if (!err && entries[i]->d_name[0] != '.') {
+			snprintf(name, sizeof(name), "%s/%s", path,
+				 entries[i]->d_name);
+			err = run_path(name);
+		}
+		free(entries[i]);
+	}
+	free(entries);
+
+	return err;
+}
+
+static int run_path(const char *path)
+{
+	struct stat st;
+	FILE *f;
+	int err;
+
+	if (stat(path, &st))
+		return -errno;
+	if (S_ISDIR(st.st_mode))
+		return run_dir(path);
+
+	f = fopen(path, "rb");
+	if (!f)
+		return -errno;
+	err = run_file(f);
+	fclose(f);
+
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	int i, err = 0;
+
+	if (argc < 2)
+		return -run_file(stdin);
+
+	for (i = 1; i < argc && !err; i++) {
+		err = run_path(argv[i]);
+		if (err)
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(-err));
+	}
+	printf("inputs: %lu\n", inputs);
+
+	return -err;
+}
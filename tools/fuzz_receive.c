@@ -0,0 +1,77 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+/*
+ * Fuzzes the receive path: the input is the byte stream of an FHZ. It is
+ * written in chunks of varying size, so frames are split and reassembled
+ * like on a serial line. Every decoded message is formatted for MQTT.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../fhz.h"
+#include "../mqtt.h"
+#include "fuzz.h"
+
+static struct fhz *fhz;
+static int fds[2];
+
+static void fuzz_init(void)
+{
+	if (pipe(fds) || fcntl(fds[0], F_SETFL, O_NONBLOCK) == -1)
+		abort();
+
+	fhz = fhz_add(fds[0]);
+	if (!fhz)
+		abort();
+
+	/* broken frames are the point, not worth a warning each */
+	log_level = -1;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	struct fhz_message message;
+	size_t off, len;
+	int err;
+
+	if (!fhz)
+		fuzz_init();
+
+	/* every input starts with an empty ring, for reproducible runs */
+	memset(&fhz->rx, 0, sizeof(fhz->rx));
+
+	if (size > FUZZ_INPUT_MAX)
+		size = FUZZ_INPUT_MAX;
+
+	/* the first byte picks the chunk size */
+	for (off = 1; off < size; off += len) {
+		len = size - off;
+		if (len > data[0] % 64 + 1)
+			len = data[0] % 64 + 1;
+		if (write(fds[1], data + off, len) != len)
+			abort();
+
+		while ((err = fhz_handle(fhz, &message)) != -EAGAIN) {
+			if (err == -EPIPE)
+				abort();
+			if (!err && !fhz_update(&message))
+				mqtt_publish(NULL, &message);
+		}
+	}
+
+	return 0;
+}
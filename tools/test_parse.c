@@ -0,0 +1,261 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+/*
+ * Pins the conversions of FHT values. Reports must be formatted exactly
+ * like the former float based "%0.1f" and "%0.2f" formats. Command payloads
+ * are parsed like the former sscanf() based parsers, except for the cases
+ * in parse_cases, which list the old and the new result.
+ *
+ * The converters are static, so fht.c is part of this file.
+ */
+
+#include "../fht.c"
+
+static unsigned int failures;
+
+/* the parsers before the fixed-point conversion, for reference */
+static int old_temp(const char *payload)
+{
+	float temp;
+
+	if (!strcasecmp(payload, "off"))
+		temp = 5.5;
+	else if (!strcasecmp(payload, "on"))
+		temp = 30.5;
+	else if (sscanf(payload, "%f", &temp) != 1)
+		return -EINVAL;
+	else if (temp < 5.5 || temp > 30.5)
+		return -ERANGE;
+
+	return (unsigned char)(temp / 0.5);
+}
+
+static int old_mode(const char *payload)
+{
+	if (!strcasecmp(payload, s_mode_auto))
+		return FHT_MODE_AUTO;
+	/* "holiday" was checked as "manual" a second time */
+	if (!strcasecmp(payload, s_mode_manual))
+		return FHT_MODE_MANU;
+
+	return -EINVAL;
+}
+
+static int old_uint(unsigned char function_id, const char *payload)
+{
+	static const unsigned int max[256] = {
+		[FHT_MONTH] = 12,
+		[FHT_DAY] = 31,
+		[FHT_HOUR] = 24,
+		[FHT_MINUTE] = 59,
+	};
+	unsigned int value;
+
+	if (sscanf(payload, "%u", &value) != 1)
+		return -EINVAL;
+
+	/* the year wrapped, or came out negative */
+	if (function_id == FHT_YEAR)
+		return value - FHT_YEAR_BASE;
+
+	if (value > max[function_id])
+		return -EINVAL;
+
+	return value;
+}
+
+static int old_convert(unsigned char function_id, const char *payload)
+{
+	switch (function_id) {
+	case FHT_MODE:
+		return old_mode(payload);
+	case FHT_YEAR:
+	case FHT_MONTH:
+	case FHT_DAY:
+	case FHT_HOUR:
+	case FHT_MINUTE:
+		return old_uint(function_id, payload);
+	default:
+		return old_temp(payload);
+	}
+}
+
+static void check_parse(unsigned char function_id, const char *payload,
+			int old, int new)
+{
+	int ret;
+
+	ret = old_convert(function_id, payload);
+	if (ret != old) {
+		fprintf(stderr, "%s \"%s\": old parser returned %d, not %d\n",
+			fht_commands[function_id].name, payload, ret, old);
+		failures++;
+	}
+
+	ret = fht_commands[function_id].input_conversion(payload);
+	if (ret != new) {
+		fprintf(stderr, "%s \"%s\": returned %d, not %d\n",
+			fht_commands[function_id].name, payload, ret, new);
+		failures++;
+	}
+}
+
+static const struct {
+	unsigned char function_id;
+	const char *payload;
+	int old, new;
+} parse_cases[] = {
+	/* unchanged */
+	{ FHT_DESIRED_TEMP, "21.5", 43, 43 },
+	{ FHT_DESIRED_TEMP, " +21.5\n", 43, 43 },
+	{ FHT_DESIRED_TEMP, "21.", 42, 42 },
+	{ FHT_DESIRED_TEMP, "21.99", 43, 43 },
+	{ FHT_DESIRED_TEMP, "5.5", 11, 11 },
+	{ FHT_DESIRED_TEMP, "30.5", 61, 61 },
+	{ FHT_DESIRED_TEMP, "OFF", 11, 11 },
+	{ FHT_DESIRED_TEMP, "on", 61, 61 },
+	{ FHT_DESIRED_TEMP, "5.49", -ERANGE, -ERANGE },
+	{ FHT_DESIRED_TEMP, "30.51", -ERANGE, -ERANGE },
+	{ FHT_DESIRED_TEMP, ".5", -ERANGE, -ERANGE },
+	{ FHT_DESIRED_TEMP, "", -EINVAL, -EINVAL },
+	{ FHT_DESIRED_TEMP, "warm", -EINVAL, -EINVAL },
+	{ FHT_MODE, "auto", FHT_MODE_AUTO, FHT_MODE_AUTO },
+	{ FHT_MODE, "MANUAL", FHT_MODE_MANU, FHT_MODE_MANU },
+	{ FHT_MODE, "holi", -EINVAL, -EINVAL },
+	{ FHT_YEAR, "2026", 26, 26 },
+	{ FHT_YEAR, "2255", 255, 255 },
+	{ FHT_MONTH, " 12 ", 12, 12 },
+	{ FHT_MONTH, "13", -EINVAL, -EINVAL },
+	{ FHT_MONTH, "-1", -EINVAL, -EINVAL },
+	{ FHT_HOUR, "24", 24, 24 },
+	{ FHT_MINUTE, "60", -EINVAL, -EINVAL },
+
+	/* trailing garbage is rejected */
+	{ FHT_DESIRED_TEMP, "21.5 C", 43, -EINVAL },
+	{ FHT_DESIRED_TEMP, "21,5", 42, -EINVAL },
+	{ FHT_MONTH, "7th", 7, -EINVAL },
+	{ FHT_HOUR, "1:30", 1, -EINVAL },
+	{ FHT_YEAR, "2026x", 26, -EINVAL },
+	/* no exponents, and no sign but + */
+	{ FHT_DESIRED_TEMP, "2.15e1", 43, -EINVAL },
+	{ FHT_DESIRED_TEMP, "-21", -ERANGE, -EINVAL },
+	/* no float rounding into the valid range */
+	{ FHT_DESIRED_TEMP, "30.5000001", 61, -ERANGE },
+	/* years are checked instead of wrapping */
+	{ FHT_YEAR, "2300", 300, -ERANGE },
+	{ FHT_YEAR, "1999", -1, -ERANGE },
+	/* holiday used to be unreachable */
+	{ FHT_MODE, "holiday", -EINVAL, FHT_MODE_HOLI },
+};
+
+/* every value the FHT accepts, in the ways it is usually written */
+static void check_parse_sweep(void)
+{
+	static const char *const formats[] = {"%u.%u", "%u.%u0", " %u.%u "};
+	char payload[32];
+	unsigned int i, j, value;
+	int ret;
+
+	for (value = 0; value <= 35 * 10; value++)
+		for (i = 0; i < ARRAY_SIZE(formats); i++) {
+			snprintf(payload, sizeof(payload), formats[i],
+				 value / 10, value % 10);
+			ret = old_temp(payload);
+			check_parse(FHT_DESIRED_TEMP, payload, ret, ret);
+		}
+
+	for (value = 0; value <= 300; value++) {
+		snprintf(payload, sizeof(payload), "%u", value);
+		for (j = FHT_MONTH; j <= FHT_MINUTE; j++) {
+			ret = old_uint(j, payload);
+			check_parse(j, payload, ret, ret);
+		}
+
+		snprintf(payload, sizeof(payload), "%u",
+			 FHT_YEAR_BASE + value);
+		ret = old_uint(FHT_YEAR, payload);
+		check_parse(FHT_YEAR, payload, ret, value <= 0xff ? ret :
+			    -ERANGE);
+	}
+}
+
+static void check_format(unsigned char function_id, unsigned int value,
+			 unsigned char status, const char *old)
+{
+	struct fht_message message = {
+		.function_id = function_id,
+		.status = status,
+		.value = value,
+	};
+	char topic[64], buffer[64];
+	struct fht_report report = {
+		.topic = topic,
+		.topic_size = sizeof(topic),
+		.value = buffer,
+		.value_size = sizeof(buffer),
+	};
+	int len;
+
+	len = fht_commands[function_id].output_conversion(&message, 0,
+							  &report);
+	if (len != (int)strlen(old) || strcmp(buffer, old)) {
+		fprintf(stderr, "%s %u: formatted \"%s\", not \"%s\"\n",
+			fht_commands[function_id].name, value, buffer, old);
+		failures++;
+	}
+}
+
+static void check_format_sweep(void)
+{
+	char old[64];
+	unsigned int value;
+
+	for (value = 0; value <= 0xff; value++) {
+		snprintf(old, sizeof(old), "%0.1f", (float)value * 0.5);
+		check_format(FHT_DESIRED_TEMP, value, 0, old);
+
+		snprintf(old, sizeof(old), "%0.1f", (float)value * 100 / 255);
+		check_format(FHT_IS_VALVE, value, 0x00, old);
+
+		snprintf(old, sizeof(old), "%u", FHT_YEAR_BASE + value);
+		check_format(FHT_YEAR, value, 0, old);
+
+		snprintf(old, sizeof(old), "%u", value);
+		check_format(FHT_MINUTE, value, 0, old);
+	}
+
+	for (value = 0; value <= 0xffff; value++) {
+		snprintf(old, sizeof(old), "%0.2f", (float)value / 10.0);
+		check_format(FHT_IS_TEMP_HIGH, value, 0, old);
+	}
+}
+
+int main(void)
+{
+	unsigned int i;
+
+	log_level = -1;
+
+	for (i = 0; i < ARRAY_SIZE(parse_cases); i++)
+		check_parse(parse_cases[i].function_id, parse_cases[i].payload,
+			    parse_cases[i].old, parse_cases[i].new);
+	check_parse_sweep();
+	check_format_sweep();
+
+	if (failures) {
+		fprintf(stderr, "test_parse: %u failures\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
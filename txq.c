@@ -0,0 +1,632 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fhz.h"
+#include "loop.h"
+#include "txq.h"
+
+/*
+ * Commands for FHTs are not written to the FHZ as soon as they arrive. The
+ * FHZ only holds a few of them until the addressed FHT wakes up, and the RF
+ * link is slow and duty-cycle limited. Commands wait in per-priority FIFOs
+ * and are written at most every interval ms, as long as less than window
+ * commands are unacknowledged. A command stays in flight until the FHT
+ * acknowledges it, and is retried if that doesn't happen in time. While the
+ * FHZ is lost, or if a frame couldn't be written, commands stay queued.
+ *
+ * A queued write to a register replaces the value of an earlier write to the
+ * same register that wasn't sent yet. Up to FHT_MAX_COMMANDS queued writes
+ * to the same FHT are sent in one frame. Low priority writes are held back a
+ * bit, so that bursts like setting the date end up in a single frame.
+ *
+ * Higher classes go first, but not forever: a class that could have been
+ * sent, but was passed over by share frames of higher ones, gets the next
+ * frame. Background work thus finishes even while commands keep coming.
+ *
+ * The writes of a weekly program upload complete together. If one of them is
+ * given up, the writes of the same upload still pending carry the failure,
+ * and the last one to be acknowledged or given up reports it.
+ */
+
+struct txq_entry {
+	struct hauscode hauscode;
+	unsigned char function_id;
+	unsigned char value;
+	unsigned char retries;
+	enum txq_priority priority;
+	/* the weekly program upload of the write, 0 for other commands */
+	unsigned int upload;
+	bool failed;
+	uint64_t queued;
+	uint64_t sent;
+	/* for tracing, in ns */
+	uint64_t received_ns;
+	uint64_t sent_ns;
+	char id[TXQ_ID_LEN];
+	struct txq_entry *next;
+};
+
+struct txq_list {
+	struct txq_entry *head;
+	struct txq_entry **tail;
+};
+
+struct txq_config txq_config = {
+	.size = 64,
+	.window = 4,
+	.interval = 500,
+	.timeout = 5 * 60 * 1000,
+	.retries = 2,
+	.hold = 1000,
+	.share = 4,
+};
+
+static const char *const txq_priority_names[TXQ_PRIOS] = {
+	[TXQ_PRIO_HIGH] = "high",
+	[TXQ_PRIO_LOW] = "low",
+	[TXQ_PRIO_IDLE] = "idle",
+};
+
+/* the transmit queue of one FHZ */
+struct txq {
+	struct fhz *fhz;
+	struct txq_entry *entries;
+	struct txq_entry *free;
+	struct txq_list queued[TXQ_PRIOS];
+	struct txq_list inflight;
+	/* frames of higher classes sent while the class was eligible */
+	unsigned int passed[TXQ_PRIOS];
+	unsigned int inflight_count, used;
+	/* the last upload, see txq_program_begin() */
+	unsigned int uploads;
+	uint64_t last_send;
+	struct loop_timer timer;
+	txq_dropped_fn *dropped;
+};
+
+static void txq_list_init(struct txq_list *list)
+{
+	list->head = NULL;
+	list->tail = &list->head;
+}
+
+static void txq_list_append(struct txq_list *list, struct txq_entry *entry)
+{
+	entry->next = NULL;
+	*list->tail = entry;
+	list->tail = &entry->next;
+}
+
+static void txq_list_prepend(struct txq_list *list, struct txq_entry *entry)
+{
+	entry->next = list->head;
+	if (!list->head)
+		list->tail = &entry->next;
+	list->head = entry;
+}
+
+static void txq_list_unlink(struct txq_list *list, struct txq_entry **p)
+{
+	struct txq_entry *entry = *p;
+
+	*p = entry->next;
+	if (list->tail == &entry->next)
+		list->tail = p;
+}
+
+static void txq_entry_free(struct txq *txq, struct txq_entry *entry)
+{
+	entry->next = txq->free;
+	txq->free = entry;
+	txq->used--;
+}
+
+/* the time the head of a queue may be sent */
+static uint64_t txq_eligible(struct txq *txq, enum txq_priority priority)
+{
+	const struct txq_entry *entry = txq->queued[priority].head;
+	uint64_t eligible = txq->last_send + txq_config.interval;
+
+	if (!entry)
+		return UINT64_MAX;
+
+	/* retries were held back long enough */
+	if (priority != TXQ_PRIO_HIGH && !entry->retries &&
+	    entry->queued + txq_config.hold > eligible)
+		eligible = entry->queued + txq_config.hold;
+
+	return eligible;
+}
+
+static void txq_rearm(struct txq *txq)
+{
+	struct txq_entry *entry;
+	uint64_t now, next = UINT64_MAX;
+	int prio;
+
+	/* nothing is sent while the FHZ is lost, see txq_resume() */
+	if (txq->inflight_count < txq_config.window && txq->fhz->fd >= 0)
+		for (prio = 0; prio < TXQ_PRIOS; prio++)
+			if (txq_eligible(txq, prio) < next)
+				next = txq_eligible(txq, prio);
+
+	for (entry = txq->inflight.head; entry; entry = entry->next)
+		if (entry->sent + txq_config.timeout < next)
+			next = entry->sent + txq_config.timeout;
+
+	if (next == UINT64_MAX) {
+		loop_timer_del(&txq->timer);
+		return;
+	}
+
+	now = loop_now();
+	loop_timer_add(&txq->timer, next > now ? next - now : 0);
+}
+
+static void txq_entry_to_trace(const struct txq_entry *entry,
+			       struct txq_trace *trace)
+{
+	trace->received = entry->received_ns;
+	trace->sent = entry->sent_ns;
+	memcpy(trace->id, entry->id, sizeof(trace->id));
+	trace->upload = entry->upload;
+	trace->failed = entry->failed;
+}
+
+/* marks the pending writes of an upload, returns false if there are none */
+static bool txq_list_fail(struct txq_list *list, unsigned int upload)
+{
+	struct txq_entry *entry;
+	bool pending = false;
+
+	for (entry = list->head; entry; entry = entry->next)
+		if (entry->upload == upload) {
+			entry->failed = true;
+			pending = true;
+		}
+
+	return pending;
+}
+
+static bool txq_program_fail(struct txq *txq, unsigned int upload)
+{
+	bool pending = txq_list_fail(&txq->inflight, upload);
+	int prio;
+
+	for (prio = 0; prio < TXQ_PRIOS; prio++)
+		pending |= txq_list_fail(&txq->queued[prio], upload);
+
+	return pending;
+}
+
+static void txq_drop(struct txq *txq, struct txq_entry *entry)
+{
+	struct txq_trace trace;
+
+	warning("fht %02u%02u: no ack for command %02x\n",
+		entry->hauscode.upper, entry->hauscode.lower,
+		entry->function_id);
+
+	/* the last write of an upload reports it */
+	if (entry->upload && txq_program_fail(txq, entry->upload))
+		goto free_out;
+
+	if (txq->dropped) {
+		txq_entry_to_trace(entry, &trace);
+		trace.acked = 0;
+		trace.failed |= !!entry->upload;
+		txq->dropped(txq->fhz, &entry->hauscode, entry->function_id,
+			     &trace);
+	}
+
+free_out:
+	txq_entry_free(txq, entry);
+}
+
+static void txq_expire(struct txq *txq, uint64_t now)
+{
+	struct txq_entry *entry, **p = &txq->inflight.head;
+
+	while ((entry = *p)) {
+		if (entry->sent + txq_config.timeout > now) {
+			p = &entry->next;
+			continue;
+		}
+
+		txq_list_unlink(&txq->inflight, p);
+		txq->inflight_count--;
+
+		if (entry->retries++ < txq_config.retries) {
+			/* retries go first, they waited long enough */
+			txq_list_prepend(&txq->queued[entry->priority], entry);
+			continue;
+		}
+
+		txq_drop(txq, entry);
+	}
+}
+
+static struct txq_entry *txq_take(struct txq *txq, int prio, uint64_t now)
+{
+	struct txq_entry *entry = txq->queued[prio].head;
+	int lower;
+
+	txq_list_unlink(&txq->queued[prio], &txq->queued[prio].head);
+
+	txq->passed[prio] = 0;
+	for (lower = prio + 1; lower < TXQ_PRIOS; lower++)
+		if (txq_eligible(txq, lower) <= now)
+			txq->passed[lower]++;
+
+	return entry;
+}
+
+static struct txq_entry *txq_next(struct txq *txq, uint64_t now)
+{
+	int prio;
+
+	if (txq->fhz->fd < 0)
+		return NULL;
+
+	/* classes that were passed over too often, the lowest one first */
+	if (txq_config.share)
+		for (prio = TXQ_PRIOS - 1; prio > 0; prio--)
+			if (txq->passed[prio] >= txq_config.share &&
+			    txq_eligible(txq, prio) <= now)
+				return txq_take(txq, prio, now);
+
+	for (prio = 0; prio < TXQ_PRIOS; prio++)
+		if (txq_eligible(txq, prio) <= now)
+			return txq_take(txq, prio, now);
+
+	return NULL;
+}
+
+/* takes other queued writes to the same FHT along with the first one */
+static unsigned int txq_batch(struct txq *txq, struct txq_entry **batch)
+{
+	const struct hauscode *hauscode = &batch[0]->hauscode;
+	struct txq_entry *entry, **p;
+	unsigned int n = 1;
+	int prio;
+
+	for (prio = 0; prio < TXQ_PRIOS; prio++) {
+		p = &txq->queued[prio].head;
+		while ((entry = *p) && n < FHT_MAX_COMMANDS) {
+			if (entry->hauscode.upper != hauscode->upper ||
+			    entry->hauscode.lower != hauscode->lower) {
+				p = &entry->next;
+				continue;
+			}
+			txq_list_unlink(&txq->queued[prio], p);
+			batch[n++] = entry;
+		}
+	}
+
+	return n;
+}
+
+/* puts a batch that wasn't sent back to the heads of the queues, in order */
+static void txq_requeue(struct txq *txq, struct txq_entry **batch,
+			unsigned int n)
+{
+	while (n--)
+		txq_list_prepend(&txq->queued[batch[n]->priority], batch[n]);
+}
+
+static void txq_run(struct loop_timer *timer)
+{
+	struct txq *txq = container_of(timer, struct txq, timer);
+	struct txq_entry *batch[FHT_MAX_COMMANDS];
+	struct fht_command_value commands[FHT_MAX_COMMANDS];
+	uint64_t now = loop_now();
+	unsigned int i, n;
+	int err;
+
+	txq_expire(txq, now);
+
+	if (txq->inflight_count < txq_config.window &&
+	    (batch[0] = txq_next(txq, now))) {
+		n = txq_batch(txq, batch);
+		for (i = 0; i < n; i++) {
+			commands[i].function_id = batch[i]->function_id;
+			commands[i].value = batch[i]->value;
+		}
+
+		txq->last_send = now;
+		err = fht_send(txq->fhz, &batch[0]->hauscode, commands, n);
+		if (err) {
+			/* not a try, sent again after the interval */
+			error("fht %02u%02u: send failed: %s\n",
+			      batch[0]->hauscode.upper,
+			      batch[0]->hauscode.lower, strerror(-err));
+			txq_requeue(txq, batch, n);
+			goto rearm_out;
+		}
+
+		for (i = 0; i < n; i++) {
+			batch[i]->sent = now;
+			batch[i]->sent_ns = metrics_now();
+			if (!batch[i]->retries)
+				metric_observe(METRIC_TXQ_WAIT_HIGH +
+					       batch[i]->priority,
+					       batch[i]->sent_ns -
+					       batch[i]->received_ns);
+			txq_list_append(&txq->inflight, batch[i]);
+		}
+		/* the window is checked per frame, a batch may exceed it */
+		txq->inflight_count += n;
+	}
+
+rearm_out:
+	txq_rearm(txq);
+}
+
+void txq_resume(struct txq *txq)
+{
+	txq_rearm(txq);
+}
+
+static void txq_entry_trace(struct txq_entry *entry, const char *id)
+{
+	entry->received_ns = metrics_now();
+	entry->id[0] = 0;
+	if (id)
+		strncat(entry->id, id, sizeof(entry->id) - 1);
+}
+
+/*
+ * Last writer wins for writes that weren't sent yet. The replaced write is
+ * never acknowledged, so the entry is traced as the new one.
+ */
+static bool txq_coalesce(struct txq *txq, const struct hauscode *hauscode,
+			 unsigned char function_id, unsigned char value,
+			 enum txq_priority priority, const char *id,
+			 unsigned int upload)
+{
+	struct txq_entry *entry, **p;
+	int prio;
+
+	for (prio = 0; prio < TXQ_PRIOS; prio++)
+		for (p = &txq->queued[prio].head; (entry = *p);
+		     p = &entry->next) {
+			if (entry->function_id != function_id ||
+			    entry->hauscode.upper != hauscode->upper ||
+			    entry->hauscode.lower != hauscode->lower)
+				continue;
+
+			entry->value = value;
+			entry->upload = upload;
+			entry->failed = false;
+			txq_entry_trace(entry, id);
+			if (priority < entry->priority) {
+				txq_list_unlink(&txq->queued[prio], p);
+				entry->priority = priority;
+				txq_list_append(&txq->queued[priority], entry);
+			}
+			return true;
+		}
+
+	return false;
+}
+
+int txq_parse_priority(const char *name)
+{
+	int prio;
+
+	for (prio = 0; prio < TXQ_PRIOS; prio++)
+		if (!strcmp(name, txq_priority_names[prio]))
+			return prio;
+
+	return -EINVAL;
+}
+
+static int __txq_push(struct txq *txq, const struct hauscode *hauscode,
+		      unsigned char function_id, unsigned char value,
+		      enum txq_priority priority, const char *id,
+		      unsigned int upload)
+{
+	struct txq_entry *entry;
+
+	if (priority >= TXQ_PRIOS)
+		return -EINVAL;
+
+	if (txq_coalesce(txq, hauscode, function_id, value, priority, id,
+			 upload)) {
+		txq_rearm(txq);
+		return 0;
+	}
+
+	entry = txq->free;
+	if (!entry)
+		return -ENOBUFS;
+	txq->free = entry->next;
+	txq->used++;
+
+	entry->hauscode = *hauscode;
+	entry->function_id = function_id;
+	entry->value = value;
+	entry->priority = priority;
+	entry->upload = upload;
+	entry->failed = false;
+	entry->retries = 0;
+	entry->queued = loop_now();
+	txq_entry_trace(entry, id);
+	txq_list_append(&txq->queued[priority], entry);
+
+	txq_rearm(txq);
+
+	return 0;
+}
+
+int txq_push(struct txq *txq, const struct hauscode *hauscode,
+	     unsigned char function_id, unsigned char value,
+	     enum txq_priority priority, const char *id)
+{
+	return __txq_push(txq, hauscode, function_id, value, priority, id, 0);
+}
+
+unsigned int txq_program_begin(struct txq *txq)
+{
+	/* 0 isn't an upload */
+	if (!++txq->uploads)
+		txq->uploads++;
+
+	return txq->uploads;
+}
+
+int txq_push_program(struct txq *txq, const struct hauscode *hauscode,
+		     unsigned char function_id, unsigned char value,
+		     enum txq_priority priority, const char *id,
+		     unsigned int upload)
+{
+	if (!upload)
+		return -EINVAL;
+
+	return __txq_push(txq, hauscode, function_id, value, priority, id,
+			  upload);
+}
+
+static void txq_account(const struct hauscode *hauscode,
+			const struct txq_trace *trace)
+{
+	struct fht_device *device;
+
+	device = fht_device_find(hauscode);
+	if (!device)
+		return;
+
+	metric_histogram_add(&device->latency[FHT_LATENCY_QUEUE],
+			     trace->sent - trace->received);
+	metric_histogram_add(&device->latency[FHT_LATENCY_RF],
+			     trace->acked - trace->sent);
+	metric_histogram_add(&device->latency[FHT_LATENCY_TOTAL],
+			     trace->acked - trace->received);
+}
+
+/* returns true and fills trace if the ack matched a command in flight */
+bool txq_ack(struct txq *txq, const struct hauscode *hauscode,
+	     unsigned char function_id, uint64_t acked,
+	     struct txq_trace *trace)
+{
+	struct txq_entry *entry, **p;
+
+	for (p = &txq->inflight.head; (entry = *p); p = &entry->next) {
+		if (entry->function_id != function_id ||
+		    entry->hauscode.upper != hauscode->upper ||
+		    entry->hauscode.lower != hauscode->lower)
+			continue;
+
+		txq_entry_to_trace(entry, trace);
+		trace->acked = acked > entry->sent_ns ? acked : entry->sent_ns;
+		txq_account(hauscode, trace);
+
+		debug("fht %02u%02u: command %02x acked after %lu ms "
+		      "(%lu ms queued)\n", hauscode->upper, hauscode->lower,
+		      function_id,
+		      (unsigned long)((trace->acked - trace->received) / 1000000),
+		      (unsigned long)((trace->sent - trace->received) / 1000000));
+
+		txq_list_unlink(&txq->inflight, p);
+		txq->inflight_count--;
+		txq_entry_free(txq, entry);
+		txq_rearm(txq);
+		return true;
+	}
+
+	return false;
+}
+
+static bool txq_list_pending(const struct txq_list *list,
+			     unsigned int upload)
+{
+	const struct txq_entry *entry;
+
+	for (entry = list->head; entry; entry = entry->next)
+		if (entry->upload == upload)
+			return true;
+
+	return false;
+}
+
+bool txq_program_pending(struct txq *txq, unsigned int upload)
+{
+	int prio;
+
+	for (prio = 0; prio < TXQ_PRIOS; prio++)
+		if (txq_list_pending(&txq->queued[prio], upload))
+			return true;
+
+	return txq_list_pending(&txq->inflight, upload);
+}
+
+unsigned int txq_depth(struct txq *txq)
+{
+	return txq->used;
+}
+
+unsigned int txq_space(struct txq *txq)
+{
+	return txq_config.size - txq->used;
+}
+
+int txq_init(struct txq **handle, struct fhz *fhz, txq_dropped_fn *dropped)
+{
+	struct txq *txq;
+	unsigned int i;
+	int prio;
+
+	if (!txq_config.size || !txq_config.window)
+		return -EINVAL;
+
+	txq = calloc(1, sizeof(*txq));
+	if (!txq)
+		return -ENOMEM;
+
+	txq->entries = calloc(txq_config.size, sizeof(*txq->entries));
+	if (!txq->entries) {
+		free(txq);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < txq_config.size; i++) {
+		txq->entries[i].next = txq->free;
+		txq->free = &txq->entries[i];
+	}
+
+	for (prio = 0; prio < TXQ_PRIOS; prio++)
+		txq_list_init(&txq->queued[prio]);
+	txq_list_init(&txq->inflight);
+
+	txq->fhz = fhz;
+	txq->dropped = dropped;
+	txq->timer.handler = txq_run;
+	*handle = txq;
+
+	return 0;
+}
+
+void txq_close(struct txq *txq)
+{
+	if (!txq)
+		return;
+
+	loop_timer_del(&txq->timer);
+	free(txq->entries);
+	free(txq);
+}
@@ -0,0 +1,100 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct fhz;
+struct hauscode;
+struct txq;
+
+/* classes of commands, a lower one waits while a higher one is queued */
+enum txq_priority {
+	TXQ_PRIO_HIGH, /* interactive, like desired-temp */
+	TXQ_PRIO_LOW, /* bulk, like the clock and weekly programs */
+	TXQ_PRIO_IDLE, /* background, like the startup prefetch */
+	TXQ_PRIOS,
+	/* picks the class of the command, see fht_set() */
+	TXQ_PRIO_DEFAULT = TXQ_PRIOS,
+};
+
+struct txq_config {
+	/* number of commands that can be queued or in flight */
+	unsigned int size;
+	/* commands the FHZ may hold before it acknowledged earlier ones */
+	unsigned int window;
+	/* ms between two frames written to the FHZ */
+	unsigned int interval;
+	/* ms until an unacknowledged command is sent again */
+	unsigned int timeout;
+	unsigned int retries;
+	/* ms low priority commands wait for more commands to the same FHT */
+	unsigned int hold;
+	/*
+	 * a class that was passed over by this many frames of higher ones
+	 * goes next, 0: strict priorities
+	 */
+	unsigned int share;
+};
+
+extern struct txq_config txq_config;
+
+/* fits correlation ids of commands, including the terminating zero */
+#define TXQ_ID_LEN 24
+
+/* life of an acknowledged command, CLOCK_MONOTONIC in ns */
+struct txq_trace {
+	uint64_t received;
+	uint64_t sent; /* the last attempt */
+	uint64_t acked;
+	char id[TXQ_ID_LEN]; /* empty if the command had none */
+	/* of the weekly program upload of the write, 0 for other commands */
+	unsigned int upload;
+	bool failed; /* of the upload, a write was given up */
+};
+
+/* called for a command that was given up after all retries */
+typedef void txq_dropped_fn(struct fhz *fhz, const struct hauscode *hauscode,
+			    unsigned char function_id,
+			    const struct txq_trace *trace);
+
+/* "high", "low" or "idle", -EINVAL otherwise */
+int txq_parse_priority(const char *name);
+
+/* each FHZ has a transmit queue of its own */
+int txq_init(struct txq **handle, struct fhz *fhz, txq_dropped_fn *dropped);
+void txq_close(struct txq *txq);
+
+int txq_push(struct txq *txq, const struct hauscode *hauscode,
+	     unsigned char function_id, unsigned char value,
+	     enum txq_priority priority, const char *id);
+/*
+ * The writes of a weekly program upload are pushed with the id returned by
+ * txq_program_begin(), and complete together.
+ */
+unsigned int txq_program_begin(struct txq *txq);
+int txq_push_program(struct txq *txq, const struct hauscode *hauscode,
+		     unsigned char function_id, unsigned char value,
+		     enum txq_priority priority, const char *id,
+		     unsigned int upload);
+/* sends the queued commands again, once the lost FHZ was reopened */
+void txq_resume(struct txq *txq);
+bool txq_ack(struct txq *txq, const struct hauscode *hauscode,
+	     unsigned char function_id, uint64_t acked,
+	     struct txq_trace *trace);
+
+/* true while a write of the weekly program upload is pending */
+bool txq_program_pending(struct txq *txq, unsigned int upload);
+
+unsigned int txq_depth(struct txq *txq);
+/* number of further commands that can be queued */
+unsigned int txq_space(struct txq *txq);